@@ -16,10 +16,18 @@
  * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
 #include <sys/mman.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/stat.h>
 #include "alloc.h"
+#include "numa.h"
 
 // Missing in the header
 #ifndef SHM_HUGE_SHIFT
@@ -28,6 +36,10 @@
 
 using namespace vcube;
 
+alloc::policy_t alloc::policy;
+
+static std::atomic<size_t> bytes_by_page[3], bytes_locked, bytes_total, bytes_peak;
+
 static size_t num_pages(size_t n, size_t page_size) {
 	size_t mask = (1LL << page_size) - 1;
 	return (n >> page_size) + !!(n & mask);
@@ -42,19 +54,63 @@ static void * map_huge(size_t n, size_t page_size, int prot, int flags) {
 	return (mem == MAP_FAILED) ? NULL : mem;
 }
 
-void * alloc::huge_impl(size_t n) {
+/* Transparent huge pages are used only for 2 MB aligned ranges, so the
+ * mapping is aligned by trimming an oversized one
+ */
+static void * map_transparent(size_t n, int prot, int flags) {
+	constexpr size_t align = 1 << 21;
+	n = num_pages(n, 21) << 21;
+	void *mem = mmap(NULL, n + align, prot, flags, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+
+	uintptr_t p = (uintptr_t) mem, a = (p + align - 1) & ~(align - 1);
+	if (a != p) {
+		munmap(mem, a - p);
+	}
+	munmap((void *) (a + n), p + align - a);
+
+	// Fails harmlessly if THP is disabled
+	madvise((void *) a, n, MADV_HUGEPAGE);
+	return (void *) a;
+}
+
+alloc::block alloc::anonymous(size_t n, int node) {
 	int prot = PROT_READ | PROT_WRITE;
 	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
 
-	void *mem = map_huge(n, 30, prot, flags);   // 1GB pages
-	if (!mem) {
-		mem = map_huge(n, 21, prot, flags); // 2MB pages
+	block b;
+	if (policy.backend == HUGETLB) {
+		for (size_t page_size : { 30, 21 }) { // 1GB, then 2MB pages
+			if ((b.mem = map_huge(n, page_size, prot, flags))) {
+				b.map_size = num_pages(n, page_size) << page_size;
+				b.pg = size_t(1) << page_size;
+				b.kind = HUGETLB;
+				break;
+			}
+		}
 	}
-	if (!mem) {
-		mem = map_huge(n, 0, prot, flags);  // Standard pages
+	if (!b.mem && (b.mem = map_transparent(n, prot, flags))) { // Standard or THP
+		b.map_size = num_pages(n, 21) << 21;
+		b.pg = 4096;
+		b.kind = TRANSPARENT;
+	}
+	if (!b.mem) {
+		return b;
+	}
+	b.map = b.mem;
+	b.n = n;
+
+	// The policy takes effect as the pages are first touched
+	if (node == INTERLEAVE) {
+		numa::interleave(b.mem, n);
+	} else if (node >= 0) {
+		numa::bind(b.mem, n, node);
 	}
 
-	return mem;
+	finish(b);
+	return b;
 }
 
 static void * map_shared(size_t n, uint32_t key, bool rdwr, size_t page_size) {
@@ -74,17 +130,144 @@ static void * map_shared(size_t n, uint32_t key, bool rdwr, size_t page_size) {
 	return (mem == (void *) -1) ? NULL : mem;
 }
 
-void * alloc::shared_impl(size_t n, uint32_t key, bool rdwr) {
-	void *mem = NULL;
+alloc::block alloc::shared(size_t n, uint32_t key, bool rdwr) {
+	block b;
 	if (rdwr) {
 		// Huge page setting is relevant only on create
-		mem = map_shared(n, key, rdwr, 30);         // 1GB pages
-		if (!mem) {
-			mem = map_shared(n, key, rdwr, 21); // 2MB pages
+		for (size_t page_size : { 30, 21 }) { // 1GB, then 2MB pages
+			if ((b.mem = map_shared(n, key, rdwr, page_size))) {
+				b.pg = size_t(1) << page_size;
+				break;
+			}
 		}
 	}
+	if (!b.mem && (b.mem = map_shared(n, key, rdwr, 0))) {
+		// An attached segment may have been created with huge pages
+		b.pg = rdwr ? 4096 : pages(b.mem, n).page_size;
+	}
+	if (!b.mem) {
+		return b;
+	}
+	b.map = b.mem;
+	b.n = b.map_size = n;
+	b.kind = SHARED;
+
+	finish(b);
+	return b;
+}
+
+alloc::block alloc::file(int fd, size_t offset, size_t n, bool rdwr) {
+	block b;
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		return b;
+	}
+
+	// The whole file is mapped, since on hugetlbfs it has to be unmapped
+	// in whole huge pages
+	size_t map_size = std::max<size_t>(offset + n, st.st_size);
+	void *map = mmap(NULL, map_size, rdwr ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		return b;
+	}
+	b.map = map;
+	b.mem = (uint8_t *) map + offset;
+	b.n = n;
+	b.map_size = map_size;
+	b.pg = pages(map, map_size).page_size; // hugetlbfs files have huge pages
+	b.kind = FILE;
+
+	finish(b);
+	return b;
+}
+
+void alloc::finish(block &b) {
+	if (policy.lock) {
+		b.is_locked = mlock(b.mem, b.n) == 0;
+		if (!b.is_locked) {
+			static std::atomic<bool> warned(false);
+			if (!warned.exchange(true)) {
+				fprintf(stderr, "Could not lock %zu MiB in memory; check \"ulimit -l\"\n", b.n >> 20);
+			}
+		}
+	}
+	account(b, 1);
+}
+
+void alloc::account(const block &b, int sign) {
+	int i = (b.pg >= (size_t(1) << 30)) ? 2 : (b.pg >= (size_t(1) << 21)) ? 1 : 0;
+	bytes_by_page[i] += sign * b.n;
+	if (b.is_locked) {
+		bytes_locked += sign * b.n;
+	}
+	size_t total = bytes_total += sign * b.n;
+	for (size_t peak = bytes_peak; total > peak && !bytes_peak.compare_exchange_weak(peak, total); ) {
+	}
+}
+
+alloc::block & alloc::block::operator = (block &&o) noexcept {
+	if (this != &o) {
+		reset();
+		std::swap(mem, o.mem);
+		std::swap(map, o.map);
+		std::swap(n, o.n);
+		std::swap(map_size, o.map_size);
+		std::swap(pg, o.pg);
+		std::swap(kind, o.kind);
+		std::swap(is_locked, o.is_locked);
+	}
+	return *this;
+}
+
+void alloc::block::reset() {
 	if (!mem) {
-		mem = map_shared(n, key, rdwr, 0);
+		return;
+	}
+	account(*this, -1);
+	if (kind == SHARED) {
+		shmdt(map);
+	} else {
+		munmap(map, map_size);
 	}
-	return mem;
+	mem = map = nullptr;
+	n = map_size = pg = 0;
+	is_locked = false;
+}
+
+alloc::stats_t alloc::stats() {
+	return { bytes_by_page[0], bytes_by_page[1], bytes_by_page[2], bytes_locked, bytes_peak };
+}
+
+alloc::pages_t alloc::pages(const void *mem, size_t n) {
+	pages_t pg = { 4096, 0 };
+	uintptr_t lo = (uintptr_t) mem, hi = lo + n;
+
+	// Sum over the mappings overlapping the range
+	std::ifstream smaps("/proc/self/smaps");
+	std::string line;
+	bool in_range = false;
+	uintptr_t start = 0, end = 0;
+	while (std::getline(smaps, line)) {
+		std::istringstream ss(line);
+		std::string key;
+		size_t kb;
+		if (sscanf(line.c_str(), "%lx-%lx ", &start, &end) == 2) {
+			in_range = start < hi && end > lo;
+		} else if (in_range && (ss >> key >> kb)) {
+			size_t overlap = std::min(end, hi) - std::max(start, lo);
+			if (key == "KernelPageSize:") {
+				pg.page_size = std::max(pg.page_size, kb << 10);
+			} else if (key == "AnonHugePages:" || key == "ShmemPmdMapped:" || key == "FilePmdMapped:") {
+				pg.huge_bytes += std::min(overlap, kb << 10);
+				if (kb) {
+					pg.page_size = std::max<size_t>(pg.page_size, 1 << 21);
+				}
+			} else if (key == "Private_Hugetlb:" || key == "Shared_Hugetlb:") {
+				pg.huge_bytes += std::min(overlap, kb << 10);
+			}
+		}
+	}
+
+	pg.huge_bytes = std::min(pg.huge_bytes, n);
+	return pg;
 }
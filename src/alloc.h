@@ -21,24 +21,132 @@
 
 #include <cstdlib>
 #include <stdint.h>
+#include <utility>
 
 namespace vcube {
 
+/* Memory for the pruning tables, the generator and the caches.  All of
+ * it comes from here, as blocks that are released when destroyed, under
+ * one policy that can be set from the command line, with counters of
+ * the memory in use by page size.
+ */
 class alloc {
     public:
-	template<typename T>
-	static T * huge(size_t n) {
-		return (T *) huge_impl(n * sizeof(T));
-	}
+	/* NUMA placement for anonymous(), if not a node number */
+	enum : int {
+		ANY_NODE = -1,
+		INTERLEAVE = -2
+	};
+
+	/* Kinds of memory behind a block */
+	enum backend_t {
+		HUGETLB,     // anonymous, in reserved 1 GiB or 2 MiB pages
+		TRANSPARENT, // anonymous, 2 MiB aligned for transparent huge pages
+		SHARED,      // SysV shared memory segment
+		FILE,        // shared mapping of a file
+	};
+
+	/* Allocation policy.  HUGETLB falls back to TRANSPARENT when no
+	 * huge pages are reserved.
+	 */
+	struct policy_t {
+		backend_t backend = HUGETLB; // for anonymous()
+		bool lock = false;           // mlock all blocks into memory
+	};
+	static policy_t policy;
+
+	/* An owned range of memory, released when destroyed */
+	class block {
+		friend class alloc;
+
+	    public:
+		block() : mem(), map(), n(), map_size(), pg(), kind(), is_locked() {
+		}
+
+		block(block &&o) noexcept : block() {
+			*this = std::move(o);
+		}
+
+		block & operator = (block &&o) noexcept;
+
+		block(const block &) = delete;
+		block & operator = (const block &) = delete;
+
+		~block() {
+			reset();
+		}
+
+		template<typename T = uint8_t>
+		T * get() const {
+			return static_cast<T *>(mem);
+		}
+
+		size_t size() const {
+			return n;
+		}
+
+		/* Page size the memory was requested with */
+		size_t page_size() const {
+			return pg;
+		}
+
+		backend_t backend() const {
+			return kind;
+		}
+
+		bool locked() const {
+			return is_locked;
+		}
+
+		explicit operator bool () const {
+			return mem;
+		}
+
+		/* Releases the memory */
+		void reset();
+
+	    private:
+		void *mem, *map;
+		size_t n, map_size, pg;
+		backend_t kind;
+		bool is_locked;
+	};
+
+	/* Private anonymous memory, placed on a NUMA node (or interleaved) as
+	 * the pages are first touched
+	 */
+	static block anonymous(size_t n, int node = ANY_NODE);
+
+	/* A SysV shared memory segment, created (rdwr) or attached read-only */
+	static block shared(size_t n, uint32_t key, bool rdwr);
+
+	/* A shared mapping of a file, of which the block is the "n" bytes
+	 * starting at "offset"
+	 */
+	static block file(int fd, size_t offset, size_t n, bool rdwr);
+
+	/* Memory in blocks currently allocated, by page size */
+	struct stats_t {
+		size_t bytes_4k;   // standard pages (or transparent huge pages)
+		size_t bytes_2m;
+		size_t bytes_1g;
+		size_t locked;
+		size_t peak;       // the highest total so far
+	};
+	static stats_t stats();
 
-	template<typename T>
-	static T * shared(size_t n, uint32_t key, bool rdwr) {
-		return (T *) shared_impl(n * sizeof(T), key, rdwr);
-	}
+	/* Page size backing a range of memory, and how much of it is in
+	 * huge pages (hugetlb or transparent), according to the kernel
+	 */
+	struct pages_t {
+		size_t page_size;
+		size_t huge_bytes;
+	};
+	static pages_t pages(const void *mem, size_t n);
 
     private:
-	static void * huge_impl(size_t n);
-	static void * shared_impl(size_t n, uint32_t key, bool rdwr);
+	static void finish(block &b);
+	static void account(const block &b, int sign);
 };
 
 }
@@ -260,6 +260,28 @@ cube & cube::setCorner4Comb(c4comb_t c4comb) {
 	return *this;
 }
 
+cube & cube::setCornerUDCycle(cudcycle_t cudcycle) {
+	// Corner indexes (low two bits) of each face in order, relative to
+	// the first: 0, then the other three in one of 3! orders
+	uint32_t order[2];
+	for (int face = 0; face < 2; face++) {
+		uint32_t cycle = face ? cudcycle % 6 : cudcycle / 6;
+		uint32_t a = cycle / 2 + 1;
+		uint32_t b = (a == 1) ? 2 : 1;
+		uint32_t c = 6 - a - b;
+		order[face] = (cycle & 1) ? (a << 2) | (c << 4) | (b << 6) : (a << 2) | (b << 4) | (c << 6);
+	}
+
+	uint8_t *corner = reinterpret_cast<uint8_t*>(&cv());
+	for (int i = 0; i < 8; i++) {
+		int face = (corner[i] >> 2) & 1;
+		corner[i] = (corner[i] & ~3) | (order[face] & 3);
+		order[face] >>= 2;
+	}
+
+	return *this;
+}
+
 cube & cube::setEdgeUD4Comb(eud4comb_t eud4comb) {
 	auto mask = unrank_8C4(eud4comb);
 
@@ -160,6 +160,8 @@ class cube_base {
 	}
 };
 
+class edgecube;
+
 class cube : public cube_base<cube> {
 	friend class cube_base<cube>;
 
@@ -330,6 +332,27 @@ class cube : public cube_base<cube> {
 		return rank_8C4(d_layer & 0xff);
 	}
 
+	/* Set the order of the corners within the U and D faces, up to turns
+	 * of those faces 0..35, keeping their orientation and U/D face
+	 * combination
+	 */
+	cube & setCornerUDCycle(cudcycle_t cudcycle);
+
+	/* Get the order of the corners within the U and D faces, up to turns
+	 * of those faces (which cycle the corner indexes) 0..35
+	 */
+	cudcycle_t getCornerUDCycle() const {
+		uint32_t d_layer = sse::bitmask(cv(), 2) & 0xff;
+		uint32_t c0 = sse::bitmask(cv(), 0) & 0xff;
+		uint32_t c1 = sse::bitmask(cv(), 1) & 0xff;
+		uint32_t u_cycle = rank_4cycle(_pext_u32(c0, d_layer ^ 0xff), _pext_u32(c1, d_layer ^ 0xff));
+		uint32_t d_cycle = rank_4cycle(_pext_u32(c0, d_layer), _pext_u32(c1, d_layer));
+		return u_cycle * 6 + d_cycle;
+	}
+
+	/* Set the edges (permutation and orientation) to those of "ec" */
+	cube & setEdges(const edgecube &ec);
+
 	/* Set a representative 12C4 equatorial / non-equatorial combination 0..494 */
 	cube & setEdge4Comb(e4comb_t e4comb);
 
@@ -508,6 +531,11 @@ class edgecube : public cube_base<edgecube> {
 	}
 };
 
+extern inline cube & cube::setEdges(const edgecube &ec) {
+	ev() = ec;
+	return *this;
+}
+
 }
 
 #endif
@@ -0,0 +1,119 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "numa.h"
+
+using namespace vcube;
+
+// From <numaif.h>, which is not installed everywhere
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+namespace {
+
+constexpr int MAX_NODES = 1024;
+constexpr int WORD_BITS = 8 * sizeof(unsigned long);
+const std::string NODE_PATH = "/sys/devices/system/node/";
+
+/* Parse a sysfs list such as "0-15,32-47" */
+std::vector<int> read_list(const std::string &filename) {
+	std::vector<int> v;
+	std::ifstream in(filename);
+	std::string s;
+	if (!std::getline(in, s)) {
+		return v;
+	}
+
+	for (size_t pos = 0; pos < s.size(); ) {
+		size_t end = s.find(',', pos);
+		if (end == std::string::npos) {
+			end = s.size();
+		}
+		auto range = s.substr(pos, end - pos);
+		auto dash = range.find('-');
+		int lo = std::stoi(range);
+		int hi = (dash == std::string::npos) ? lo : std::stoi(range.substr(dash + 1));
+		for (int i = lo; i <= hi; i++) {
+			v.push_back(i);
+		}
+		pos = end + 1;
+	}
+
+	return v;
+}
+
+bool set_policy(void *mem, size_t len, int mode, const std::vector<int> &nodes) {
+	unsigned long mask[MAX_NODES / WORD_BITS] = {};
+	for (auto node : nodes) {
+		if (node < 0 || node >= MAX_NODES) {
+			return false;
+		}
+		mask[node / WORD_BITS] |= 1UL << (node % WORD_BITS);
+	}
+	return syscall(SYS_mbind, mem, len, mode, mask, MAX_NODES + 1, 0) == 0;
+}
+
+}
+
+std::vector<int> numa::nodes() {
+	auto cpu = read_list(NODE_PATH + "has_cpu");
+	auto mem = read_list(NODE_PATH + "has_memory");
+
+	std::vector<int> v;
+	std::set_intersection(cpu.begin(), cpu.end(), mem.begin(), mem.end(), std::back_inserter(v));
+	if (v.empty()) {
+		v.push_back(0);
+	}
+	return v;
+}
+
+bool numa::pin(int node) {
+	auto cpus = read_list(NODE_PATH + "node" + std::to_string(node) + "/cpulist");
+	if (cpus.empty()) {
+		return false;
+	}
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (auto cpu : cpus) {
+		if (cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &set);
+		}
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool numa::bind(void *mem, size_t len, int node) {
+	return set_policy(mem, len, MPOL_PREFERRED, { node });
+}
+
+bool numa::interleave(void *mem, size_t len) {
+	auto mem_nodes = read_list(NODE_PATH + "has_memory");
+	return mem_nodes.size() > 1 && set_policy(mem, len, MPOL_INTERLEAVE, mem_nodes);
+}
@@ -0,0 +1,46 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VCUBE_NUMA_H
+#define VCUBE_NUMA_H
+
+#include <vector>
+#include <cstddef>
+
+namespace vcube::numa {
+
+/* NUMA nodes that have both CPUs and memory, in ascending order.  On
+ * systems without NUMA support this is a single node 0.
+ */
+std::vector<int> nodes();
+
+/* Restrict the calling thread to the CPUs of a node */
+bool pin(int node);
+
+/* Set the memory policy of a mapping; this must be done before its
+ * pages are first touched.  Memory is placed on the node if possible,
+ * and falls back to other nodes when it is full.
+ */
+bool bind(void *mem, size_t len, int node);
+
+/* Spread the pages of a mapping across all nodes with memory */
+bool interleave(void *mem, size_t len);
+
+}
+
+#endif
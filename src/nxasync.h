@@ -0,0 +1,119 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VCUBE_NXASYNC_H
+#define VCUBE_NXASYNC_H
+
+#include <deque>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "nxsolve.h"
+
+namespace vcube::nx {
+
+/* Non-blocking front end to nx::solver.  Cubes are queued to a pool of
+ * worker threads, each with its own solver sharing the same pruning table.
+ * Results are delivered either through a std::future or a callback (which
+ * runs on the worker thread.)  solver_base::init() must be called first.
+ */
+template<typename prune_t>
+class async_solver {
+	using callback_t = std::function<void(moveseq_t)>;
+
+	struct job_t {
+		cube c;
+		int limit;
+		callback_t done;
+	};
+
+    public:
+	async_solver(prune_t &P, int n_threads) : P(P), stopping() {
+		for (int i = 0; i < std::max(1, n_threads); i++) {
+			workers.emplace_back([this]() { run(); });
+		}
+	}
+
+	/* Finishes all queued jobs before returning */
+	~async_solver() {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stopping = true;
+		}
+		cv.notify_all();
+		for (auto &t : workers) {
+			t.join();
+		}
+	}
+
+	async_solver(const async_solver &) = delete;
+	async_solver & operator = (const async_solver &) = delete;
+
+	void solve(const cube &c, int limit, callback_t done) {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			jobs.push_back({ c, limit, std::move(done) });
+		}
+		cv.notify_one();
+	}
+
+	std::future<moveseq_t> solve(const cube &c, int limit = 20) {
+		auto promise = std::make_shared<std::promise<moveseq_t>>();
+		auto future = promise->get_future();
+		solve(c, limit, [promise](moveseq_t moves) {
+				promise->set_value(std::move(moves));
+				});
+		return future;
+	}
+
+	/* Number of jobs waiting for a worker */
+	size_t pending() {
+		std::lock_guard<std::mutex> lock(mtx);
+		return jobs.size();
+	}
+
+    private:
+	prune_t &P;
+	std::vector<std::thread> workers;
+	std::deque<job_t> jobs;
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool stopping;
+
+	void run() {
+		solver<prune_t> S(P);
+		for (;;) {
+			std::unique_lock<std::mutex> lock(mtx);
+			cv.wait(lock, [this]() { return stopping || !jobs.empty(); });
+			if (jobs.empty()) {
+				return;
+			}
+			auto job = std::move(jobs.front());
+			jobs.pop_front();
+			lock.unlock();
+
+			job.done(S.solve(job.c, job.limit));
+		}
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,238 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include "nxdisk.h"
+#include "alloc.h"
+#include "uring.h"
+
+using namespace vcube::nx;
+
+namespace {
+
+/* Reads are whole aligned blocks, as required by O_DIRECT */
+constexpr size_t READ_BLOCK = 4096;
+
+/* Each thread has its own ring and read buffers */
+struct reader_t {
+	vcube::uring ring;
+	uint8_t *buf;
+
+	explicit reader_t(size_t n) : ring(n), buf() {
+		buf = static_cast<uint8_t *>(aligned_alloc(READ_BLOCK, n * READ_BLOCK));
+	}
+
+	~reader_t() {
+		free(buf);
+	}
+};
+
+}
+
+disk_prune_base::disk_prune_base(size_t stride, uint32_t variant, uint32_t base, uint32_t encoding, size_t stripe_bytes) :
+	prune_base(stride, variant, base, encoding), stripe_bytes(stripe_bytes), fd(-1), data_offset(), row_mem(N_CORNER_SYM), cache(), cache_size(),
+	n_stripes(), n_reads(), n_errors()
+{
+}
+
+disk_prune_base::~disk_prune_base() {
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+bool disk_prune_base::open(const std::string &filename, const table_options &opt, size_t cache_bytes) {
+	fd = openInPlace(filename, opt, data_offset);
+	if (fd == -1) {
+		return false;
+	}
+
+	// Rows are chosen by the number of corner positions that map to
+	// them; classes with fewer symmetries stand for more positions
+	std::vector<uint32_t> weight(N_CORNER_SYM);
+	for (corient_t corient = 0; corient < N_CORIENT; corient++) {
+		for (c4comb_t c4comb = 0; c4comb < N_C4COMB; c4comb++) {
+			cube c;
+			c.setCorner4Comb(c4comb);
+			c.setCornerOrient(corient);
+			weight[sym_coord(c)]++;
+		}
+	}
+	std::vector<uint32_t> rows(N_CORNER_SYM);
+	std::iota(rows.begin(), rows.end(), 0);
+	std::stable_sort(rows.begin(), rows.end(), [&](uint32_t a, uint32_t b) {
+			return weight[a] > weight[b];
+			});
+	rows.resize(std::min<size_t>(N_CORNER_SYM, cache_bytes / stride));
+
+	// The cache is read through the page cache, since rows need not be
+	// aligned for O_DIRECT
+	cache_size = rows.size() * stride;
+	if (rows.empty()) {
+		return true;
+	}
+	cache = alloc::anonymous(cache_size, opt.node);
+	int cache_fd = ::open(filename.c_str(), O_RDONLY);
+	if (!cache || cache_fd == -1) {
+		if (cache_fd != -1) {
+			close(cache_fd);
+		}
+		cache.reset();
+		cache_size = 0;
+		return false;
+	}
+
+	std::atomic<size_t> next(0);
+	std::atomic<bool> ok(true);
+	std::vector<std::thread> workers;
+	for (int i = 0; i < std::max(1, opt.n_threads); i++) {
+		workers.push_back(std::thread([&]() {
+				for (size_t r; ok && (r = next++) < rows.size(); ) {
+					uint8_t *dst = cache.get() + r * stride;
+					off_t src = data_offset + off_t(row_pos[rows[r]]) * stride;
+					for (size_t got = 0; got < stride; ) {
+						ssize_t n = pread(cache_fd, dst + got, stride - got, src + got);
+						if (n <= 0) {
+							ok = false;
+							break;
+						}
+						got += n;
+					}
+					row_mem[row_pos[rows[r]]] = dst;
+				}
+				}));
+	}
+	for (auto &t : workers) {
+		t.join();
+	}
+	posix_fadvise(cache_fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(cache_fd);
+
+	fprintf(stderr, "%s: %lu of %u rows cached (%.1f%% of positions)\n", filename.c_str(),
+			rows.size(), N_CORNER_SYM,
+			100.0 * std::accumulate(rows.begin(), rows.end(), 0.0, [&](double sum, uint32_t r) {
+				return sum + weight[r];
+				}) / (double(N_CORIENT) * N_C4COMB));
+
+	return ok;
+}
+
+void disk_prune_base::fetch(const stripe_ref_t *ref, uint8_t *val, size_t n, decode_t decode) const {
+	static thread_local reader_t reader(MAX_FETCH);
+
+	size_t n_disk = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (ref[i].mem) {
+			val[i] = decode(ref[i].mem, ref[i].edge);
+		} else {
+			uint64_t off = data_offset + ref[i].off;
+			reader.ring.read(fd, reader.buf + i * READ_BLOCK, READ_BLOCK, off & ~(READ_BLOCK - 1), i);
+			val[i] = 0;
+			n_disk++;
+		}
+	}
+	if (!n_disk) {
+		n_stripes += n;
+		return;
+	}
+
+	size_t n_ok = 0;
+	bool read_ok[MAX_FETCH] = {};
+	reader.ring.wait_all([&](uint64_t i, int res) {
+			uint64_t in_block = (data_offset + ref[i].off) & (READ_BLOCK - 1);
+			if (res >= int(in_block + stripe_bytes)) {
+				val[i] = decode(reader.buf + i * READ_BLOCK + in_block, ref[i].edge);
+				read_ok[i] = true;
+				n_ok++;
+			}
+			});
+
+	n_stripes += n;
+	n_reads += n_disk;
+	if (n_ok == n_disk) {
+		return;
+	}
+
+	// Retry the failed reads synchronously
+	n_errors += n_disk - n_ok;
+	for (size_t i = 0; i < n; i++) {
+		if (ref[i].mem || read_ok[i]) {
+			continue;
+		}
+		uint64_t off = data_offset + ref[i].off, in_block = off & (READ_BLOCK - 1);
+		ssize_t res = pread(fd, reader.buf + i * READ_BLOCK, READ_BLOCK, off - in_block);
+		if (res < ssize_t(in_block + stripe_bytes)) {
+			fprintf(stderr, "Pruning table read at offset %lu failed: %s\n", off,
+					res == -1 ? strerror(errno) : "short read");
+			exit(EXIT_FAILURE);
+		}
+		val[i] = decode(reader.buf + i * READ_BLOCK + in_block, ref[i].edge);
+	}
+}
+
+uint8_t disk_prune_base::combine(const uint8_t *prune, int skip, uint8_t limit, uint32_t &prune_vals, uint8_t &axis_mask, uint32_t corner_idx) const {
+	for (int i = 0; i < 3; i++) {
+		if (i != skip && prune[i] > limit) {
+			return prune[i];
+		}
+	}
+
+	prune_vals = (prune[0] << 0) | (prune[1] << 4) | (prune[2] << 8);
+	if (!prune_vals) {
+		// No axis is ruled out
+		axis_mask = 0;
+		return 0;
+	}
+
+	uint8_t prune0 = max3(prune[0], prune[1], prune[2]);
+	if (prune0 > limit) {
+		return prune0;
+	}
+
+	for (int i = 3; i < 6; i++) {
+		if (i != skip && prune[i] > limit) {
+			return prune[i];
+		}
+	}
+
+	prune_vals |= (prune[3] << 12) | (prune[4] << 16) | (prune[5] << 20);
+
+	uint8_t prune1 = max3(prune[3], prune[4], prune[5]);
+	if (prune1 > limit) {
+		return prune1;
+	}
+
+	axis_mask = 0;
+	for (int i = 0; i < 6; i++) {
+		axis_mask |= (prune[i] == limit) << i;
+	}
+
+	uint8_t prune_max = std::max(prune0, prune1);
+	if (corners) {
+		prune_max = std::max(prune_max, corners->get(corner_idx));
+	}
+	return prune_max;
+}
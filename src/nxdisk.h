@@ -0,0 +1,206 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VCUBE_NXDISK_H
+#define VCUBE_NXDISK_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "nxprune.h"
+
+namespace vcube::nx {
+
+/* A pruning table that stays in its file, for tables larger than memory
+ * (e.g. on local NVMe storage.)  The rows most likely to be used are
+ * read into a cache in memory; all other stripes are read from the file
+ * on demand in 4 KiB blocks, with io_uring.  The search calls lookup(),
+ * which issues the up to six reads of one position together and blocks
+ * until they complete; reads are not overlapped across positions or
+ * searches.  Only lookup_many (used for --hardest-first) puts reads for
+ * many positions in flight at once.  To keep the device busy, run
+ * several times more workers than cores.
+ */
+class disk_prune_base : public prune_base {
+    public:
+	/* Opens the table file and fills the cache with up to cache_bytes
+	 * of rows, starting with the corner classes that stand for the
+	 * most corner positions
+	 */
+	bool open(const std::string &filename, const table_options &opt, size_t cache_bytes);
+
+	/* Bytes of the table held in memory */
+	size_t cached() const {
+		return cache_size;
+	}
+
+	/* Stripes looked up, and how many of them were read from the file */
+	uint64_t stripes() const {
+		return n_stripes;
+	}
+
+	uint64_t reads() const {
+		return n_reads;
+	}
+
+	/* Reads that failed and were retried with pread.  A read that
+	 * fails again ends the program, rather than quietly giving a
+	 * weaker bound.
+	 */
+	uint64_t errors() const {
+		return n_errors;
+	}
+
+    protected:
+	disk_prune_base(size_t stride, uint32_t variant, uint32_t base, uint32_t encoding, size_t stripe_bytes);
+	~disk_prune_base();
+
+	/* One stripe to fetch: in memory if "mem" is set, or else at byte
+	 * offset "off" of the table data
+	 */
+	struct stripe_ref_t {
+		const uint8_t *mem;
+		uint64_t off;
+		uint32_t edge;
+	};
+
+	/* Most stripes fetched in one call */
+	static constexpr size_t MAX_FETCH = 384;
+
+	/* The value of an entry in its stripe: Encoding::fetch<Base> */
+	using decode_t = uint8_t (*)(const uint8_t *stripe, uint32_t edge);
+
+	/* Sets val[i] to the table value for each ref[i] */
+	void fetch(const stripe_ref_t *ref, uint8_t *val, size_t n, decode_t decode) const;
+
+	/* The bound of prune::lookup, from all six table values */
+	uint8_t combine(const uint8_t *prune, int skip, uint8_t limit, uint32_t &prune_vals, uint8_t &axis_mask, uint32_t corner_idx) const;
+
+	static uint8_t max3(uint8_t a, uint8_t b, uint8_t c) {
+		uint32_t cmp = (1 << a) | (1 << b) | (1 << c);
+		cmp |= _blsi_u32(cmp) << 1;
+		return 31 - _lzcnt_u32(cmp);
+	}
+
+	size_t stripe_bytes;
+	int fd;
+	off_t data_offset;
+	std::vector<const uint8_t *> row_mem; // by position in the file
+	alloc::block cache;
+	size_t cache_size;
+
+	mutable std::atomic<uint64_t> n_stripes, n_reads, n_errors;
+};
+
+template<typename ECoord, int Base, typename Encoding = encoding_2bit>
+class disk_prune : public disk_prune_base {
+	stripe_ref_t locate(const cube &c) const {
+		auto &idx = index[c.getCornerOrient()];
+		auto &os = idx.os[c.getCorner4Comb()];
+		uint32_t edge = ECoord(c, os.sym);
+		uint32_t row = row_pos[idx.base] + os.offset;
+		uint64_t off = STRIPE_BYTES * (edge / 64);
+		if (row_mem[row]) {
+			return { row_mem[row] + off, 0, edge };
+		}
+		return { nullptr, row * stride + off, edge };
+	}
+
+    public:
+	using ecoord = ECoord;
+	using encoding = Encoding;
+	static constexpr uint64_t N_EDGE_STRIPE = ecoord::N_ECOORD / 64;
+	static constexpr size_t STRIPE_BYTES = Encoding::STRIPE_BYTES;
+	static constexpr int BASE = Base;
+
+	disk_prune() : disk_prune_base(STRIPE_BYTES * N_EDGE_STRIPE, ecoord::ID, Base, Encoding::ID, STRIPE_BYTES) {
+	}
+
+	uint8_t lookup(const cube6 &c6, uint8_t limit, uint32_t &prune_vals, int skip, int val, uint8_t &axis_mask) const {
+		stripe_ref_t ref[6];
+		uint8_t prune[6], map[6];
+		size_t n = 0;
+		for (int i = 0; i < 6; i++) {
+			if (i != skip) {
+				map[n] = i;
+				ref[n++] = locate(c6[i]);
+			}
+		}
+
+		uint32_t corner_idx = 0;
+		if (corners) {
+			corner_idx = corner_table::index(c6[0]);
+			corners->prefetch(corner_idx);
+		}
+
+		uint8_t got[6];
+		fetch(ref, got, n, Encoding::template fetch<Base>);
+		for (size_t i = 0; i < n; i++) {
+			prune[map[i]] = got[i];
+		}
+		if (skip >= 0 && skip < 6) {
+			prune[skip] = val;
+		}
+
+		return combine(prune, skip, limit, prune_vals, axis_mask, corner_idx);
+	}
+
+	uint8_t initial_depth(const cube6 &c6) const {
+		uint32_t prune_vals;
+		uint8_t axis_mask;
+		return lookup(c6, 0xff, prune_vals, -1, 0, axis_mask);
+	}
+
+	/* Same as initial_depth for each of "n" positions, with the reads
+	 * for a group of positions in flight together
+	 */
+	void lookup_many(const cube6 *c6, size_t n, uint8_t *depth) const {
+		constexpr size_t GROUP = MAX_FETCH / 6;
+		stripe_ref_t ref[GROUP * 6];
+		uint8_t prune[GROUP * 6];
+
+		for (size_t first = 0; first < n; first += GROUP) {
+			size_t len = std::min(GROUP, n - first);
+			for (size_t i = 0; i < len; i++) {
+				for (int j = 0; j < 6; j++) {
+					ref[i * 6 + j] = locate(c6[first + i][j]);
+				}
+			}
+
+			fetch(ref, prune, len * 6, Encoding::template fetch<Base>);
+
+			for (size_t i = 0; i < len; i++) {
+				auto p = &prune[i * 6];
+				if (!(p[0] | p[1] | p[2])) {
+					depth[first + i] = 0;
+					continue;
+				}
+
+				uint8_t d = std::max(max3(p[0], p[1], p[2]), max3(p[3], p[4], p[5]));
+				if (corners) {
+					d = std::max(d, corners->get(corner_table::index(c6[first + i][0])));
+				}
+				depth[first + i] = d;
+			}
+		}
+	}
+};
+
+}
+
+#endif
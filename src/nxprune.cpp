@@ -17,16 +17,540 @@
  */
 
 #include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
 #include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/types.h>
 #include "nxprune.h"
 #include "alloc.h"
+#include "rans.h"
+
+// Missing in older headers
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
 
 using namespace vcube::nx;
 
-prune_base::prune_base(size_t stride) : os_unique(), index(), stride(stride) {
+namespace vcube::nx {
+
+/* Table file header.  It is followed by one checksum per TABLE_BLOCK
+ * of table data, and padded to a multiple of FILE_ALIGN bytes.  In
+ * compressed files, the checksums are followed by n_blocks + 1 offsets
+ * of the compressed blocks, relative to the end of the header.
+ */
+struct table_header_t {
+	char magic[8];
+	uint32_t format;
+	uint32_t header_size; // offset of the table data
+	uint32_t variant;     // ecoord ID (e.g. 308)
+	uint32_t base;
+	uint64_t stride;
+	uint32_t n_rows;
+	uint32_t generator;   // prune_base::GENERATOR_VERSION
+	uint32_t block_size;
+	uint32_t n_blocks;
+	uint32_t flags;
+	uint32_t encoding;    // value encoding ID (e.g. encoding_2bit::ID)
+};
+
+}
+
+namespace {
+
+/* Table files are read, written and checksummed in blocks of this size */
+constexpr size_t TABLE_BLOCK = 64 << 20;
+
+/* Alignment of the table data within the file (for O_DIRECT and mmap) */
+constexpr size_t FILE_ALIGN = 4096;
+
+constexpr char TABLE_MAGIC[8] = "vcnxtbl";
+constexpr uint32_t TABLE_FORMAT = 1;
+constexpr uint32_t FLAG_VERIFIED = 1;
+constexpr uint32_t FLAG_COMPRESSED = 2;
+constexpr uint32_t FLAG_CLUSTERED = 4;   // table_options::ROWS_CLUSTERED
+constexpr uint32_t FLAG_DERIVED = 8;     // projected from a larger table
+
+/* Flags describing the table contents, kept when a file is rewritten */
+constexpr uint32_t CONTENT_FLAGS = FLAG_CLUSTERED | FLAG_DERIVED;
+
+/* Runs fn(offset, length) over consecutive blocks of [0, size) using
+ * multiple threads, and reports progress to stderr.  Returns false if
+ * any call to fn failed.
+ */
+bool parallel_chunks(size_t size, int n_threads, const char *what, const std::function<bool(size_t, size_t)> &fn) {
+	std::atomic<size_t> next(0), done(0);
+	std::atomic<bool> ok(true);
+	std::mutex mtx;
+
+	auto t0 = std::chrono::steady_clock::now();
+	auto t_report = t0;
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < std::max(1, n_threads); i++) {
+		workers.push_back(std::thread([&]() {
+			for (size_t off; ok && (off = next.fetch_add(TABLE_BLOCK)) < size; ) {
+				size_t len = std::min(TABLE_BLOCK, size - off);
+				if (!fn(off, len)) {
+					ok = false;
+				}
+				size_t d = done += len;
+
+				std::lock_guard<std::mutex> lock(mtx);
+				auto now = std::chrono::steady_clock::now();
+				if (now - t_report >= std::chrono::seconds(1) || d == size) {
+					t_report = now;
+					std::chrono::duration<double> elapsed = now - t0;
+					fprintf(stderr, "%s: %lu/%lu MiB (%.06f)\n", what, d >> 20, size >> 20, elapsed.count());
+				}
+			}
+		}));
+	}
+
+	for (auto &t : workers) {
+		t.join();
+	}
+
+	return ok;
+}
+
+/* Fletcher-style checksum over 64-bit lanes, fast enough to keep up
+ * with memory bandwidth
+ */
+uint64_t checksum(const uint8_t *p, size_t len) {
+	__m256i a = _mm256_setzero_si256(), b = _mm256_setzero_si256();
+	auto v = reinterpret_cast<const __m256i *>(p);
+	for (size_t i = 0; i < len / 32; i++) {
+		a = _mm256_add_epi64(a, _mm256_loadu_si256(v + i));
+		b = _mm256_add_epi64(b, a);
+	}
+
+	uint64_t lanes[8];
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), a);
+	_mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes + 4), b);
+
+	uint64_t h = len;
+	for (auto x : lanes) {
+		h = (h ^ x) * 0x9e3779b97f4a7c15ULL;
+	}
+	for (size_t i = len & ~size_t(31); i < len; i++) {
+		h = (h ^ p[i]) * 0x9e3779b97f4a7c15ULL;
+	}
+	return h ^ (h >> 32);
+}
+
+std::vector<uint64_t> checksum_blocks(const uint8_t *mem, size_t size, int n_threads) {
+	std::vector<uint64_t> sums((size + TABLE_BLOCK - 1) / TABLE_BLOCK);
+	parallel_chunks(size, n_threads, "checksum", [&](size_t off, size_t len) {
+			sums[off / TABLE_BLOCK] = checksum(mem + off, len);
+			return true;
+			});
+	return sums;
+}
+
+bool verify_blocks(const uint8_t *mem, size_t size, const std::vector<uint64_t> &sums, int n_threads) {
+	return parallel_chunks(size, n_threads, "verify", [&](size_t off, size_t len) {
+			if (checksum(mem + off, len) != sums[off / TABLE_BLOCK]) {
+				fprintf(stderr, "Checksum mismatch in block at offset %lu\n", off);
+				return false;
+			}
+			return true;
+			});
+}
+
+/* Serialized header, checksums and compressed block offsets (if any),
+ * padded to the data offset
+ */
+std::vector<uint8_t> make_header(const table_header_t &h_in, const std::vector<uint64_t> &sums, const std::vector<uint64_t> &offsets = {}) {
+	table_header_t h = h_in;
+	memcpy(h.magic, TABLE_MAGIC, sizeof(h.magic));
+	h.format = TABLE_FORMAT;
+	h.block_size = TABLE_BLOCK;
+	h.n_blocks = sums.size();
+	h.flags = (h_in.flags & CONTENT_FLAGS) | (offsets.empty() ? 0 : FLAG_COMPRESSED);
+	h.header_size = (sizeof(h) + 8 * (sums.size() + offsets.size()) + FILE_ALIGN - 1) / FILE_ALIGN * FILE_ALIGN;
+
+	std::vector<uint8_t> buf(h.header_size);
+	memcpy(buf.data(), &h, sizeof(h));
+	memcpy(buf.data() + sizeof(h), sums.data(), 8 * sums.size());
+	memcpy(buf.data() + sizeof(h) + 8 * sums.size(), offsets.data(), 8 * offsets.size());
+	return buf;
+}
+
+/* A SysV semaphore set with the same key as a shared memory table.
+ * Semaphore 0 is held while loading the segment, and is released if
+ * its holder dies; semaphore 1 is set once the segment is completely
+ * loaded and verified.
+ */
+struct shm_marker {
+	enum { LOCK, READY };
+
+	union semun {
+		int val;
+	};
+
+	int sem;
+
+	shm_marker(uint32_t key, bool create) : sem(semget(key, 2, 0600 | (create ? IPC_CREAT : 0))) {
+	}
+
+	bool ready() const {
+		return sem != -1 && semctl(sem, READY, GETVAL) == 1;
+	}
+
+	void setReady(bool ready) {
+		semun arg = { ready };
+		semctl(sem, READY, SETVAL, arg);
+	}
+
+	bool lock(uint32_t key) {
+		// Wait for zero, then increment
+		sembuf op[] = { { LOCK, 0, IPC_NOWAIT }, { LOCK, 1, SEM_UNDO } };
+		if (sem == -1) {
+			return false;
+		} else if (semop(sem, op, 2) == 0) {
+			return true;
+		} else if (errno != EAGAIN) {
+			return false;
+		}
+		fprintf(stderr, "Waiting for another process to load shared memory table 0x%08x\n", key);
+		op[0].sem_flg = 0;
+		while (semop(sem, op, 2) == -1) {
+			if (errno != EINTR) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void unlock() {
+		sembuf op = { LOCK, -1, SEM_UNDO };
+		semop(sem, &op, 1);
+	}
+};
+
+/* An open table file with its header validated */
+struct table_file {
+	int fd = -1;
+	bool direct = false;
+	bool hugetlbfs = false;
+	bool legacy = false; // raw table data without a header
+	bool compressed = false;
+	table_header_t h = {};
+	std::vector<uint64_t> sums;
+	std::vector<uint64_t> offsets; // compressed block offsets
+
+	~table_file() {
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+
+	/* Opens a table file and checks that its header matches "expect" */
+	bool open(const std::string &filename, const table_header_t &expect, size_t size, bool direct = false) {
+		if (direct) {
+			fd = ::open(filename.c_str(), O_RDONLY | O_DIRECT);
+		}
+		if (fd == -1) {
+			// Not all file systems support O_DIRECT
+			direct = false;
+			fd = ::open(filename.c_str(), O_RDONLY);
+		}
+		if (fd == -1) {
+			return false;
+		}
+		this->direct = direct;
+
+		struct stat st;
+		struct statfs sfs;
+		if (fstat(fd, &st) == -1) {
+			return false;
+		}
+		hugetlbfs = fstatfs(fd, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC;
+
+		// Files on hugetlbfs are padded to a whole number of huge pages
+		auto size_ok = [&](size_t expect_size) {
+			return hugetlbfs ? size_t(st.st_size) >= expect_size : size_t(st.st_size) == expect_size;
+		};
+
+		std::vector<uint8_t> buf;
+		if (!read_aligned(buf, 0, FILE_ALIGN) || memcmp(buf.data(), TABLE_MAGIC, sizeof(TABLE_MAGIC))) {
+			// Tables saved before the header was introduced, which
+			// were all 2-bit tables
+			if (expect.encoding == encoding_2bit::ID && size_ok(size)) {
+				fprintf(stderr, "%s: no header, table contents are not verified\n", filename.c_str());
+				legacy = true;
+				return true;
+			}
+			fprintf(stderr, "%s: not a table file\n", filename.c_str());
+			return false;
+		}
+
+		memcpy(&h, buf.data(), sizeof(h));
+		compressed = h.flags & FLAG_COMPRESSED;
+		size_t n_blocks = (size + TABLE_BLOCK - 1) / TABLE_BLOCK;
+		size_t n_offsets = compressed ? n_blocks + 1 : 0;
+		if (h.format != TABLE_FORMAT || h.generator != expect.generator ||
+				h.variant != expect.variant || h.base != expect.base ||
+				h.encoding != expect.encoding ||
+				h.stride != expect.stride || h.n_rows != expect.n_rows ||
+				h.block_size != TABLE_BLOCK || h.n_blocks != n_blocks ||
+				h.header_size % FILE_ALIGN || h.header_size < sizeof(h) + 8 * (n_blocks + n_offsets))
+		{
+			fprintf(stderr, "%s: table is for variant %u base %u encoding %u (format %u, generator %u), expected variant %u base %u encoding %u (format %u, generator %u)\n",
+					filename.c_str(), h.variant, h.base, h.encoding, h.format, h.generator,
+					expect.variant, expect.base, expect.encoding, TABLE_FORMAT, expect.generator);
+			return false;
+		}
+		if (!read_aligned(buf, 0, h.header_size)) {
+			return false;
+		}
+		sums.resize(n_blocks);
+		memcpy(sums.data(), buf.data() + sizeof(h), 8 * n_blocks);
+		offsets.resize(n_offsets);
+		memcpy(offsets.data(), buf.data() + sizeof(h) + 8 * n_blocks, 8 * n_offsets);
+
+		if (compressed && (offsets[0] != 0 || !std::is_sorted(offsets.begin(), offsets.end()))) {
+			fprintf(stderr, "%s: bad block offsets\n", filename.c_str());
+			return false;
+		}
+		if (!size_ok(h.header_size + (compressed ? offsets.back() : size))) {
+			fprintf(stderr, "%s: wrong size (truncated?)\n", filename.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	table_options::row_order_t rows() const {
+		return (h.flags & FLAG_CLUSTERED) ? table_options::ROWS_CLUSTERED : table_options::ROWS_NATURAL;
+	}
+
+	/* Reads the table data with multiple threads.  The memory must be
+	 * rounded up to a multiple of the page size, as O_DIRECT reads whole
+	 * blocks.
+	 */
+	bool read(uint8_t *mem, size_t size, int n_threads) const {
+		if (compressed) {
+			return read_compressed(mem, size, n_threads);
+		}
+		return parallel_chunks(size, n_threads, "read", [=](size_t off, size_t len) {
+				size_t want = direct ? (len + FILE_ALIGN - 1) & ~(FILE_ALIGN - 1) : len;
+				for (size_t got = 0; got < len; ) {
+					ssize_t n = pread(fd, mem + off + got, want - got, h.header_size + off + got);
+					if (n <= 0) {
+						return false;
+					}
+					got += n;
+				}
+				return true;
+				});
+	}
+
+	/* Checks the table data against the header checksums if requested,
+	 * or if it has never been done for this file
+	 */
+	bool verify(const std::string &filename, const uint8_t *mem, size_t size, const table_options &opt) const {
+		if (!needs_verify(opt)) {
+			return true;
+		}
+
+		if (!verify_blocks(mem, size, sums, opt.n_threads)) {
+			fprintf(stderr, "%s: table is corrupt\n", filename.c_str());
+			return false;
+		}
+
+		mark_verified(filename);
+		return true;
+	}
+
+	/* Same as verify, but reads the table data from the file one block
+	 * at a time, for tables that are not loaded into memory
+	 */
+	bool verify_file(const std::string &filename, size_t size, const table_options &opt) const {
+		if (!needs_verify(opt) || compressed) {
+			return true;
+		}
+
+		bool ok = parallel_chunks(size, opt.n_threads, "verify", [&](size_t off, size_t len) {
+				std::vector<uint8_t> buf;
+				if (!read_aligned(buf, h.header_size + off, (len + FILE_ALIGN - 1) & ~(FILE_ALIGN - 1), len)) {
+					return false;
+				}
+				if (checksum(buf.data(), len) != sums[off / TABLE_BLOCK]) {
+					fprintf(stderr, "Checksum mismatch in block at offset %lu\n", off);
+					return false;
+				}
+				return true;
+				});
+		if (!ok) {
+			fprintf(stderr, "%s: table is corrupt\n", filename.c_str());
+			return false;
+		}
+
+		mark_verified(filename);
+		return true;
+	}
+
+    private:
+	bool needs_verify(const table_options &opt) const {
+		if (legacy || opt.verify == table_options::VERIFY_NEVER) {
+			return false;
+		}
+		return opt.verify == table_options::VERIFY_ALWAYS || !(h.flags & FLAG_VERIFIED);
+	}
+
+	/* Remember the result so later loads can skip verification */
+	void mark_verified(const std::string &filename) const {
+		uint32_t flags = h.flags | FLAG_VERIFIED;
+		off_t flags_off = offsetof(table_header_t, flags);
+		int wfd = ::open(filename.c_str(), O_RDWR);
+		if (wfd != -1) {
+			if (pwrite(wfd, &flags, sizeof(flags), flags_off) != sizeof(flags)) {
+				// hugetlbfs does not support write
+				void *hdr = mmap(NULL, FILE_ALIGN, PROT_READ | PROT_WRITE, MAP_SHARED, wfd, 0);
+				if (hdr != MAP_FAILED) {
+					memcpy((uint8_t *) hdr + flags_off, &flags, sizeof(flags));
+					munmap(hdr, FILE_ALIGN);
+				}
+			}
+			close(wfd);
+		}
+	}
+
+	/* Each thread reads whole compressed blocks and decodes them
+	 * directly into the table memory
+	 */
+	bool read_compressed(uint8_t *mem, size_t size, int n_threads) const {
+		return parallel_chunks(size, n_threads, "decompress", [=](size_t off, size_t len) {
+				size_t block = off / TABLE_BLOCK;
+				off_t start = h.header_size + offsets[block];
+				size_t in_len = offsets[block + 1] - offsets[block];
+
+				// O_DIRECT reads must be aligned at both ends
+				off_t skip = direct ? start % FILE_ALIGN : 0;
+				size_t want = direct ? (skip + in_len + FILE_ALIGN - 1) & ~(FILE_ALIGN - 1) : in_len;
+				std::vector<uint8_t> buf;
+				if (!read_aligned(buf, start - skip, want, skip + in_len)) {
+					return false;
+				}
+				if (!vcube::rans::decode(buf.data() + skip, in_len, mem + off, len)) {
+					fprintf(stderr, "Bad compressed block at offset %lu\n", off);
+					return false;
+				}
+				return true;
+				});
+	}
+
+	/* Reads "len" bytes, of which the first "need" must be present
+	 * (a read rounded up for O_DIRECT may run past the end of the file)
+	 */
+	bool read_aligned(std::vector<uint8_t> &buf, off_t off, size_t len, size_t need = 0) const {
+		// O_DIRECT requires an aligned buffer
+		need = need ? need : len;
+		void *p = aligned_alloc(FILE_ALIGN, len);
+		if (!p) {
+			return false;
+		}
+		size_t got = 0;
+		while (got < need) {
+			ssize_t n = pread(fd, (uint8_t *) p + got, len - got, off + got);
+			if (n <= 0) {
+				break;
+			}
+			got += n;
+		}
+		buf.assign((uint8_t *) p, (uint8_t *) p + len);
+		free(p);
+		return got >= need;
+	}
+};
+
+}
+
+void corner_table::generate(int n_threads, int max_depth) {
+	// Move tables for the permutation and orientation coordinates
+	std::vector<std::array<uint16_t, N_MOVES>> perm_move(N_CPERM), orient_move(N_CORIENT);
+	for (cperm_t cperm = 0; cperm < N_CPERM; cperm++) {
+		cube c;
+		c.setCornerPerm(cperm);
+		for (int m = 0; m < N_MOVES; m++) {
+			perm_move[cperm][m] = c.move(m).getCornerPerm();
+		}
+	}
+	for (corient_t corient = 0; corient < N_CORIENT; corient++) {
+		cube c;
+		c.setCornerOrient(corient);
+		for (int m = 0; m < N_MOVES; m++) {
+			orient_move[corient][m] = c.move(m).getCornerOrient();
+		}
+	}
+
+	// Breadth-first search, one byte per position.  Threads may race to
+	// set the same unvisited position, but always to the same value.
+	std::vector<uint8_t> dist(N_POSITIONS, 0xff);
+	dist[index(cube())] = 0;
+	constexpr size_t CHUNK = 1 << 20;
+	for (uint8_t depth = 0, found = 1; found && depth < max_depth; depth++) {
+		std::atomic<size_t> next(0), n_found(0);
+		std::vector<std::thread> workers;
+		for (int i = 0; i < std::max(1, n_threads); i++) {
+			workers.push_back(std::thread([&]() {
+				size_t n = 0;
+				for (size_t off; (off = next.fetch_add(CHUNK)) < N_POSITIONS; ) {
+					for (size_t idx = off; idx < std::min(off + CHUNK, N_POSITIONS); idx++) {
+						if (__atomic_load_n(&dist[idx], __ATOMIC_RELAXED) != depth) {
+							continue;
+						}
+						auto cperm = idx / N_CORIENT, corient = idx % N_CORIENT;
+						for (int m = 0; m < N_MOVES; m++) {
+							auto next_idx = size_t(perm_move[cperm][m]) * N_CORIENT + orient_move[corient][m];
+							if (__atomic_load_n(&dist[next_idx], __ATOMIC_RELAXED) == 0xff) {
+								__atomic_store_n(&dist[next_idx], depth + 1, __ATOMIC_RELAXED);
+								n++;
+							}
+						}
+					}
+				}
+				n_found += n;
+			}));
+		}
+		for (auto &t : workers) {
+			t.join();
+		}
+		found = n_found > 0;
+	}
+
+	block = alloc::anonymous(N_POSITIONS / 2);
+	tbl = block.get();
+	uint8_t unvisited = max_depth + 1;
+	for (size_t idx = 0; idx < N_POSITIONS; idx += 2) {
+		tbl[idx / 2] = std::min(dist[idx], unvisited) | (std::min(dist[idx + 1], unvisited) << 4);
+	}
+}
+
+prune_base::prune_base(size_t stride, uint32_t variant, uint32_t base, uint32_t encoding) :
+	os_unique(), index(), row_pos(), row_order(table_options::ROWS_NATURAL), table(), mem(),
+	stride(stride), variant(variant), base(base), encoding(encoding), legacy_file(), compressed_file(), derived_table(), corners()
+{
 	os_unique_t os_tmp;
 	auto os_next = os_unique.begin();
 	decltype(index_t::base) next_symcoord = 0;
@@ -72,95 +596,461 @@ prune_base::prune_base(size_t stride) : os_unique(), index(), stride(stride) {
 
 		idx.os = &(*os_found)[0];
 	}
+
+	setRowOrder(table_options::ROWS_NATURAL);
+}
+
+table_header_t prune_base::header_template() const {
+	table_header_t h = {};
+	h.variant = variant;
+	h.base = base;
+	h.encoding = encoding;
+	h.stride = stride;
+	h.n_rows = N_CORNER_SYM;
+	h.generator = GENERATOR_VERSION;
+	h.flags = (row_order == table_options::ROWS_CLUSTERED) ? FLAG_CLUSTERED : 0;
+	h.flags |= derived_table ? FLAG_DERIVED : 0;
+	return h;
 }
 
 void prune_base::setPrune(decltype(index_t::prune) p) {
+	mem = p;
 	for (auto &idx : index) {
-		idx.prune = p + idx.base * stride;
+		idx.prune = p + row_pos[idx.base] * stride;
 	}
 }
 
-bool prune_base::save(const std::string &filename) const {
+/* Takes ownership of the table memory, releasing the previous table */
+void prune_base::setPrune(alloc::block &&b) {
+	table = std::move(b);
+	setPrune(table.get());
+}
+
+void prune_base::setRowOrder(table_options::row_order_t order) {
+	row_order = order;
+	for (uint32_t row = 0; row < N_CORNER_SYM; row++) {
+		row_pos[row] = row;
+	}
+	if (order == table_options::ROWS_NATURAL) {
+		return;
+	}
+
+	// Rows with the same corner orientation representative form a
+	// group, which is moved as a whole
+	std::vector<uint16_t> group_first;
+	for (corient_t corient = 0; corient < N_CORIENT; corient++) {
+		group_first.push_back(index[corient].base);
+	}
+	std::sort(group_first.begin(), group_first.end());
+	group_first.erase(std::unique(group_first.begin(), group_first.end()), group_first.end());
+	size_t n_groups = group_first.size();
+	group_first.push_back(N_CORNER_SYM);
+
+	std::vector<uint16_t> group(N_CORNER_SYM);
+	for (size_t g = 0; g < n_groups; g++) {
+		std::fill(group.begin() + group_first[g], group.begin() + group_first[g + 1], g);
+	}
+
+	// Number of moves between each pair of groups
+	std::vector<uint32_t> weight(n_groups * n_groups);
+	auto corner_rep = getCornerRepresentatives();
+	for (uint32_t row = 0; row < N_CORNER_SYM; row++) {
+		for (int m = 0; m < N_MOVES; m++) {
+			weight[group[row] * n_groups + group[sym_coord(corner_rep[row].move(m))]]++;
+		}
+	}
+
+	// Cuthill-McKee ordering from the solved group, visiting the
+	// neighbors of each group by decreasing number of moves
+	std::vector<uint16_t> group_order = { 0 };
+	std::vector<bool> placed(n_groups);
+	placed[0] = true;
+	for (size_t i = 0; i < group_order.size(); i++) {
+		auto w = &weight[group_order[i] * n_groups];
+		std::vector<uint16_t> next;
+		for (size_t g = 0; g < n_groups; g++) {
+			if (w[g] && !placed[g]) {
+				next.push_back(g);
+				placed[g] = true;
+			}
+		}
+		std::stable_sort(next.begin(), next.end(), [w](uint16_t a, uint16_t b) {
+				return w[a] > w[b];
+				});
+		group_order.insert(group_order.end(), next.begin(), next.end());
+	}
+
+	uint16_t pos = 0;
+	for (auto g : group_order) {
+		for (uint32_t row = group_first[g]; row < group_first[g + 1]; row++) {
+			row_pos[row] = pos++;
+		}
+	}
+}
+
+void prune_base::reorder(table_options::row_order_t order) {
+	if (order == row_order) {
+		return;
+	}
+
+	// Move the rows in place, following each cycle of the permutation
+	// with one row of scratch space (a row can be hundreds of MiB)
+	auto old_pos = row_pos;
+	setRowOrder(order);
+	std::vector<uint16_t> dest(N_CORNER_SYM);
+	for (uint32_t row = 0; row < N_CORNER_SYM; row++) {
+		dest[old_pos[row]] = row_pos[row];
+	}
+
+	std::vector<uint8_t> tmp(stride);
+	std::vector<bool> moved(N_CORNER_SYM);
+	for (uint32_t start = 0; start < N_CORNER_SYM; start++) {
+		if (moved[start] || dest[start] == start) {
+			continue;
+		}
+		memcpy(tmp.data(), mem + start * stride, stride);
+		for (uint32_t p = dest[start]; !moved[start]; p = dest[p]) {
+			std::swap_ranges(tmp.begin(), tmp.end(), mem + p * stride);
+			moved[p] = true;
+		}
+	}
+
+	setPrune(mem);
+}
+
+bool prune_base::save(const std::string &filename, const table_options &opt) const {
 	auto dir = filename;
 	(void) mkdir(dirname(dir.data()), 0777);
 
+	size_t sz = stride * N_CORNER_SYM;
+	auto sums = checksum_blocks(mem, sz, opt.n_threads);
+	auto header = make_header(header_template(), sums);
+
 	auto tmpname = filename + ".tmp";
 	FILE *fp = fopen(tmpname.c_str(), "w");
 	if (!fp) {
 		return false;
 	}
-	size_t n = fwrite(index[0].prune, stride, N_CORNER_SYM, fp);
-	if (fclose(fp)) {
-		return false;
+	bool ok;
+	if (opt.compress) {
+		ok = save_compressed(fp, sums, opt.n_threads);
+	} else {
+		size_t nh = fwrite(header.data(), header.size(), 1, fp);
+		size_t n = fwrite(mem, stride, N_CORNER_SYM, fp);
+		ok = nh == 1 && n == N_CORNER_SYM;
 	}
-	if (n != N_CORNER_SYM) {
+	if (fclose(fp) || !ok) {
+		unlink(tmpname.c_str());
 		return false;
 	}
 	return rename(tmpname.c_str(), filename.c_str()) == 0;
 }
 
-bool prune_base::load(const std::string &filename) {
+bool prune_base::save_compressed(FILE *fp, const std::vector<uint64_t> &sums, int n_threads) const {
 	size_t sz = stride * N_CORNER_SYM;
+	std::vector<uint64_t> offsets(sums.size() + 1);
 
-	FILE *fp = fopen(filename.c_str(), "r");
-	if (!fp) {
+	// The header size does not depend on the offsets, so the data is
+	// written first and the header filled in afterward
+	auto header = make_header(header_template(), sums, offsets);
+	if (fseek(fp, header.size(), SEEK_SET) == -1) {
 		return false;
 	}
 
-	auto mem = alloc::huge<uint8_t>(sz);
-	if (!mem) {
-		fclose(fp);
+	// Blocks are compressed in parallel, one wave of n_threads blocks
+	// at a time, and written in order
+	auto t0 = std::chrono::steady_clock::now();
+	std::vector<std::vector<uint8_t>> out(std::max(1, n_threads));
+	for (size_t first = 0; first < sums.size(); first += out.size()) {
+		size_t n = std::min(out.size(), sums.size() - first);
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < n; i++) {
+			workers.push_back(std::thread([&, i]() {
+						size_t off = (first + i) * TABLE_BLOCK;
+						out[i].clear();
+						vcube::rans::encode(mem + off, std::min(TABLE_BLOCK, sz - off), out[i]);
+						}));
+		}
+		for (auto &t : workers) {
+			t.join();
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			offsets[first + i + 1] = offsets[first + i] + out[i].size();
+			if (fwrite(out[i].data(), out[i].size(), 1, fp) != 1) {
+				return false;
+			}
+		}
+
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+		size_t done = std::min(sz, (first + n) * TABLE_BLOCK);
+		fprintf(stderr, "compress: %lu/%lu MiB -> %lu MiB (%.06f)\n",
+				done >> 20, sz >> 20, offsets[first + n] >> 20, elapsed.count());
+	}
+
+	header = make_header(header_template(), sums, offsets);
+	return fseek(fp, 0, SEEK_SET) == 0 && fwrite(header.data(), header.size(), 1, fp) == 1;
+}
+
+bool prune_base::load(const std::string &filename, const table_options &opt) {
+	size_t sz = stride * N_CORNER_SYM;
+
+	table_file tf;
+	if (!tf.open(filename, header_template(), sz, opt.direct)) {
 		return false;
 	}
 
-	size_t n = fread(mem, stride, N_CORNER_SYM, fp);
-	if (fclose(fp)) {
+	auto mem = alloc::anonymous(sz, opt.node);
+	if (!mem) {
 		return false;
 	}
 
-	if (n != N_CORNER_SYM) {
+	if (!tf.read(mem.get(), sz, opt.n_threads) || !tf.verify(filename, mem.get(), sz, opt)) {
 		return false;
 	}
 
-	setPrune(mem);
+	legacy_file = tf.legacy;
+	compressed_file = tf.compressed;
+	derived_table = tf.h.flags & FLAG_DERIVED;
+	setRowOrder(tf.rows());
+	setPrune(std::move(mem));
 
 	return true;
 }
 
-bool prune_base::loadShared(uint32_t key, const std::string &filename) {
+bool prune_base::loadShared(uint32_t key, const std::string &filename, const table_options &opt) {
 	size_t sz = stride * N_CORNER_SYM;
 
-	auto mem = alloc::shared<uint8_t>(sz, key, false);
-	if (!mem) {
-		if (filename.empty()) {
-			return false;
+	// Only a segment marked as completely loaded is attached
+	shm_marker marker(key, !filename.empty());
+	auto mem = marker.ready() ? alloc::shared(sz, key, false) : alloc::block();
+	if (mem) {
+		setRowOrder(opt.rows);
+		setPrune(std::move(mem));
+		return true;
+	}
+
+	// Only one process loads the segment, while the others wait for it
+	if (filename.empty() || !marker.lock(key)) {
+		return false;
+	}
+
+	bool ok = false;
+	if (marker.ready() && (mem = alloc::shared(sz, key, false))) {
+		// Loaded by another process in the meantime
+		setRowOrder(opt.rows);
+		setPrune(std::move(mem));
+		ok = true;
+	} else {
+		table_file tf;
+		marker.setReady(false);
+		if (tf.open(filename, header_template(), sz, opt.direct)) {
+			// Replace a segment left by an interrupted load
+			int stale = shmget(key, 0, 0);
+			if (stale != -1) {
+				shmctl(stale, IPC_RMID, NULL);
+			}
+			mem = alloc::shared(sz, key, true);
+		}
+		if (mem && tf.read(mem.get(), sz, opt.n_threads) && tf.verify(filename, mem.get(), sz, opt)) {
+			// Others attach to the segment expecting opt.rows
+			derived_table = tf.h.flags & FLAG_DERIVED;
+			setRowOrder(tf.rows());
+			setPrune(std::move(mem));
+			reorder(opt.rows);
+			marker.setReady(true);
+			ok = true;
 		}
+	}
+	marker.unlock();
 
-		mem = alloc::shared<uint8_t>(sz, key, true);
-		if (!mem) {
-			return false;
+	return ok;
+}
+
+bool prune_base::createMapped(const std::string &filename, const table_options &opt, const std::string &source) const {
+	size_t sz = stride * N_CORNER_SYM;
+
+	table_file src;
+	if (!src.open(source, header_template(), sz)) {
+		return false;
+	}
+
+	// Files on hugetlbfs must be sized in whole huge pages
+	auto tmpname = filename + ".tmp";
+	auto h = header_template();
+	h.flags = src.h.flags & CONTENT_FLAGS;
+	auto header = make_header(h, src.legacy ? std::vector<uint64_t>((sz + TABLE_BLOCK - 1) / TABLE_BLOCK) : src.sums);
+	size_t map_sz = header.size() + sz;
+	struct statfs sfs;
+	int dst = open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (dst != -1 && fstatfs(dst, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC) {
+		map_sz = (map_sz + sfs.f_bsize - 1) / sfs.f_bsize * sfs.f_bsize;
+	}
+	if (dst == -1 || ftruncate(dst, map_sz) == -1) {
+		if (dst != -1) {
+			close(dst);
+			unlink(tmpname.c_str());
 		}
+		return false;
+	}
 
-		FILE *fp = fopen(filename.c_str(), "r");
-		if (!fp) {
-			return false;
+	auto map = alloc::file(dst, 0, map_sz, true);
+	close(dst);
+	uint8_t *mem = map.get() + header.size();
+	bool ok = map && src.read(mem, sz, opt.n_threads) && src.verify(source, mem, sz, opt);
+	if (ok) {
+		if (src.legacy) {
+			header = make_header(h, checksum_blocks(mem, sz, opt.n_threads));
+		} else if (opt.verify != table_options::VERIFY_NEVER) {
+			// The copy was checked against the source checksums
+			reinterpret_cast<table_header_t *>(header.data())->flags |= FLAG_VERIFIED;
 		}
+		memcpy(map.get(), header.data(), header.size());
+	}
+	map.reset();
+
+	if (!ok || rename(tmpname.c_str(), filename.c_str()) != 0) {
+		unlink(tmpname.c_str());
+		return false;
+	}
+
+	return true;
+}
 
-		size_t n = fread(mem, stride, N_CORNER_SYM, fp);
-		if (fclose(fp)) {
+bool prune_base::loadMapped(const std::string &filename, const table_options &opt, const std::string &source) {
+	size_t sz = stride * N_CORNER_SYM;
+
+	if (access(filename.c_str(), F_OK) != 0) {
+		if (source.empty()) {
 			return false;
 		}
 
-		if (n != N_CORNER_SYM) {
+		// Only one process creates the file, while the others wait for
+		// it.  The lock is released if its holder dies, and the file
+		// appears under its final name only once it is complete and
+		// verified, so a partially loaded table is never mapped.
+		int lock = open((filename + ".lock").c_str(), O_RDWR | O_CREAT, 0644);
+		if (lock == -1) {
+			return false;
+		}
+		if (flock(lock, LOCK_EX | LOCK_NB) == -1) {
+			fprintf(stderr, "Waiting for another process to load %s\n", filename.c_str());
+			(void) flock(lock, LOCK_EX);
+		}
+		bool ok = access(filename.c_str(), F_OK) == 0 || createMapped(filename, opt, source);
+		close(lock);
+		if (!ok) {
 			return false;
 		}
 	}
 
-	setPrune(mem);
+	table_file tf;
+	if (!tf.open(filename, header_template(), sz)) {
+		return false;
+	}
+	if (tf.compressed) {
+		fprintf(stderr, "%s: compressed tables cannot be mapped directly\n", filename.c_str());
+		return false;
+	}
+
+	auto map = alloc::file(tf.fd, tf.h.header_size, sz, false);
+	if (!map) {
+		return false;
+	}
+	uint8_t *mem = map.get();
+
+	fprintf(stderr, "Mapping %s (%s)\n", filename.c_str(), tf.hugetlbfs ? "hugetlbfs" : "page cache");
+
+	// Prefault all pages so lookups never wait on disk
+	parallel_chunks(sz, opt.n_threads, "prefault", [mem](size_t off, size_t len) {
+			auto p = (volatile uint8_t *) mem + off;
+			if (madvise((void *) p, len, MADV_POPULATE_READ) == -1) {
+				// Kernels before 5.14 need the pages touched one at a time
+				for (size_t i = 0; i < len; i += 4096) {
+					(void) p[i];
+				}
+			}
+			return true;
+			});
+
+	if (!tf.verify(filename, mem, sz, opt)) {
+		return false;
+	}
+
+	legacy_file = tf.legacy;
+	compressed_file = false;
+	derived_table = tf.h.flags & FLAG_DERIVED;
+	setRowOrder(tf.rows());
+	setPrune(std::move(map));
+
+	return true;
+}
+
+bool prune_base::replicate(const prune_base &src, const table_options &opt) {
+	size_t sz = stride * N_CORNER_SYM;
+	if (src.stride != stride || src.variant != variant || src.base != base || src.encoding != encoding) {
+		return false;
+	}
+
+	auto block = alloc::anonymous(sz, opt.node);
+	if (!block) {
+		return false;
+	}
+
+	uint8_t *mem = block.get();
+	const uint8_t *from = src.mem;
+	parallel_chunks(sz, opt.n_threads, "replicate", [=](size_t off, size_t len) {
+			memcpy(mem + off, from + off, len);
+			return true;
+			});
+
+	legacy_file = src.legacy_file;
+	compressed_file = src.compressed_file;
+	derived_table = src.derived_table;
+	setRowOrder(src.row_order);
+	setPrune(std::move(block));
 
 	return true;
 }
 
+bool prune_base::verify(const std::string &filename, const table_options &opt) const {
+	size_t sz = stride * N_CORNER_SYM;
+
+	table_file tf;
+	if (!tf.open(filename, header_template(), sz) || tf.legacy) {
+		return false;
+	}
+	if (tf.rows() != row_order) {
+		fprintf(stderr, "%s: rows are in a different order than the table in memory\n", filename.c_str());
+		return false;
+	}
+
+	return verify_blocks(mem, sz, tf.sums, opt.n_threads);
+}
+
+int prune_base::openInPlace(const std::string &filename, const table_options &opt, off_t &data_offset) {
+	size_t sz = stride * N_CORNER_SYM;
+
+	table_file tf;
+	if (!tf.open(filename, header_template(), sz, true)) {
+		return -1;
+	}
+	if (tf.compressed) {
+		fprintf(stderr, "%s: compressed tables cannot be read in place\n", filename.c_str());
+		return -1;
+	}
+	if (!tf.verify_file(filename, sz, opt)) {
+		return -1;
+	}
+
+	legacy_file = tf.legacy;
+	compressed_file = false;
+	derived_table = tf.h.flags & FLAG_DERIVED;
+	setRowOrder(tf.rows());
+	data_offset = tf.legacy ? 0 : tf.h.header_size;
+	return dup(tf.fd);
+}
+
 std::vector<vcube::cube> prune_base::getCornerRepresentatives() const {
 	std::vector<cube> cv;
 	for (corient_t corient = 0; corient < N_CORIENT; corient++) {
@@ -19,13 +19,17 @@
 #ifndef VCUBE_NXPRUNE_H
 #define VCUBE_NXPRUNE_H
 
+#include <algorithm>
 #include <array>
 #include <vector>
 #include <tuple>
+#include <utility>
 #include <cstdio>
+#include <sys/types.h>
 #include "cube.h"
 #include "cube6.h"
 #include "sse_cube.h"
+#include "alloc.h"
 
 /* This implements the pruning tables used by Tomas Rokicki's nxopt.
  * See https://github.com/rokicki/cube20src for a better description
@@ -83,6 +87,15 @@ class ecoord {
     public:
 	static constexpr uint32_t N_ECOORD = N_EP[EP] * N_EO[EO] * 512;
 
+	/* Variant number as used on the command line, e.g. 308 */
+	static constexpr uint32_t ID = (EP + 1) * 100 + (EO + 1) * 4;
+
+	/* The edge part of the coordinate, and the number of corner
+	 * permutation values it is combined with (see cpcoord)
+	 */
+	using edges = ecoord;
+	static constexpr uint32_t N_CP = 1;
+
 	ecoord() : coord() {
 	}
 
@@ -225,6 +238,59 @@ class ecoord {
 	uint32_t coord;
 };
 
+/* An edge coordinate combined with the order of the corners within the
+ * U and D faces.  The pruning table rows (corner sym-coordinates) already
+ * hold the corner orientation and which corners are in the U and D
+ * faces, so with the row this is the full corner permutation, up to turns
+ * of the U and D faces.
+ *
+ * The coordinate of each axis must not change when that axis' faces are
+ * turned before the cube (the search reuses the inverse cube's value
+ * across moves of the same axis), which is why it cannot hold the full
+ * 4! * 4! order or the corner parity.
+ *
+ * The corner part is the most significant, so the stripes (and their
+ * unused first two entries) are the same as the edge coordinate's.
+ */
+template<typename ECoord>
+class cpcoord {
+    public:
+	using edges = ECoord;
+	static constexpr uint32_t N_CP = N_CUDCYCLE;
+	static_assert(uint64_t(N_CP) * ECoord::N_ECOORD <= UINT32_MAX, "coordinate does not fit in 32 bits");
+	static constexpr uint32_t N_ECOORD = N_CP * ECoord::N_ECOORD;
+
+	/* Variant number as used on the command line, e.g. 1104 */
+	static constexpr uint32_t ID = 1000 + ECoord::ID;
+
+	cpcoord() : coord() {
+	}
+
+	cpcoord(const cube &c, int sym = 0) {
+		cube c_s = c.symConjugate(sym);
+		coord = getCP(c_s) * ECoord::N_ECOORD + ECoord(c_s);
+	}
+
+	operator uint32_t () const {
+		return coord;
+	}
+
+	/* The corner part of a cube's coordinate */
+	static uint32_t getCP(const cube &c) {
+		return c.getCornerUDCycle();
+	}
+
+	/* Returns a cube with the corner part "cp", and the same corner
+	 * orientation and U/D face combination as "c"
+	 */
+	static cube setCP(cube c, uint32_t cp) {
+		return c.setCornerUDCycle(cp);
+	}
+
+    private:
+	uint32_t coord;
+};
+
 /* Edge coordinate representative cube generator */
 class ecoord_rep {
     public:
@@ -285,6 +351,67 @@ class ccoord {
 	uint32_t coord;
 };
 
+struct table_header_t;
+
+/* Exact number of moves to solve the corners, indexed by corner
+ * permutation and orientation (8! * 3^7 = 88M positions) at 4 bits per
+ * entry.  Combined with the nx table, it gives a better lower bound for
+ * positions where the corners are far from solved.
+ */
+class corner_table {
+	alloc::block block;
+	uint8_t *tbl;
+
+    public:
+	static constexpr size_t N_POSITIONS = size_t(N_CPERM) * N_CORIENT;
+
+	corner_table() : block(), tbl() {
+	}
+
+	/* Positions more than "max_depth" moves from solved get max_depth + 1,
+	 * which is still a lower bound; the default covers them all
+	 */
+	void generate(int n_threads = 1, int max_depth = 14);
+
+	static uint32_t index(const cube &c) {
+		return c.getCornerPerm() * N_CORIENT + c.getCornerOrient();
+	}
+
+	void prefetch(uint32_t idx) const {
+		_mm_prefetch(&tbl[idx / 2], _MM_HINT_T0);
+	}
+
+	uint8_t get(uint32_t idx) const {
+		return (tbl[idx / 2] >> (idx % 2 * 4)) & 0xf;
+	}
+};
+
+/* Options for reading and writing pruning table files */
+struct table_options {
+	enum verify_t {
+		VERIFY_AUTO,   // verify unless the file was verified before
+		VERIFY_ALWAYS,
+		VERIFY_NEVER
+	};
+
+	/* Order of the corner sym-coordinate rows in memory.  Table files
+	 * record their own order; this one applies to shared memory tables
+	 * attached without a file, and to tables loaded into new shared
+	 * memory segments.
+	 */
+	enum row_order_t {
+		ROWS_NATURAL,   // sym-coordinate order
+		ROWS_CLUSTERED  // neighboring corner classes close together
+	};
+
+	int n_threads = 1;     // threads for reading and checksums
+	bool direct = false;   // read with O_DIRECT, bypassing the page cache
+	bool compress = false; // save in the compressed format
+	int node = -1;         // NUMA placement (alloc::anonymous) of loaded tables
+	verify_t verify = VERIFY_AUTO;
+	row_order_t rows = ROWS_NATURAL;
+};
+
 /* The pruning table is indexed first by corner sym-coordinate.
  * This class is responsible for the mapping of raw corners to
  * sym corners
@@ -310,19 +437,100 @@ class prune_base {
 		return stride * N_CORNER_SYM;
 	}
 
-	bool save(const std::string &filename) const;
-	bool load(const std::string &filename);
-	bool loadShared(uint32_t key, const std::string &filename = "");
+	const uint8_t * data() const {
+		return mem;
+	}
+
+	/* Table files begin with a header identifying the table variant and
+	 * generator version, and a checksum for each block of table data.
+	 * Files from older versions without a header are still accepted.
+	 */
+	bool save(const std::string &filename, const table_options &opt = {}) const;
+	bool load(const std::string &filename, const table_options &opt = {});
+	bool loadShared(uint32_t key, const std::string &filename = "", const table_options &opt = {});
+
+	/* Map the table file directly into memory instead of reading it,
+	 * prefaulting the pages with multiple threads.  If the file is on
+	 * a hugetlbfs mount, the table is backed by huge pages.  If the file
+	 * does not exist and a source filename is given, the file is first
+	 * created and filled from the source (this is the only way to get
+	 * data into a hugetlbfs file, which does not support write.)
+	 * Concurrent processes wait for the one creating the file, so a
+	 * table in /dev/shm or on hugetlbfs can be shared safely.
+	 */
+	bool loadMapped(const std::string &filename, const table_options &opt = {}, const std::string &source = "");
+
+	/* Copy a loaded table into new memory, e.g. one replica per NUMA
+	 * node as given by opt.node
+	 */
+	bool replicate(const prune_base &src, const table_options &opt = {});
+
+	/* Check the table in memory (e.g. an attached shared memory table)
+	 * against the checksums in a table file
+	 */
+	bool verify(const std::string &filename, const table_options &opt = {}) const;
+
+	/* True if the last loaded table file had no header */
+	bool legacy() const {
+		return legacy_file;
+	}
+
+	/* True if the last loaded table file was compressed */
+	bool compressed() const {
+		return compressed_file;
+	}
+
+	/* True if the table was derived from a larger one (see
+	 * prune_deriver) rather than generated
+	 */
+	bool derived() const {
+		return derived_table;
+	}
+
+	/* Rearrange the rows of a table in writable memory (not one from
+	 * loadMapped).  Rows are moved in whole corner orientation groups,
+	 * which stay contiguous, so lookups cost the same in either order.
+	 * The clustered order places groups reached from each other by one
+	 * move close together, so the lookups for the children of a search
+	 * node share more huge pages and TLB entries.  It is saved with the
+	 * table.
+	 */
+	void reorder(table_options::row_order_t order);
+
+	table_options::row_order_t rowOrder() const {
+		return row_order;
+	}
+
+	/* Also use an exact corner table as a lower bound in lookups */
+	void setCornerTable(const corner_table *ct) {
+		corners = ct;
+	}
+
+	/* Bump this whenever the generator output changes */
+	static constexpr uint32_t GENERATOR_VERSION = 1;
 
     protected:
-	prune_base(size_t stride);
+	prune_base(size_t stride, uint32_t variant, uint32_t base, uint32_t encoding = 0);
+
+	table_header_t header_template() const;
+
+	bool createMapped(const std::string &filename, const table_options &opt, const std::string &source) const;
+
+	/* Opens a table file to be read in place instead of loaded (with
+	 * O_DIRECT where supported), verifying it first if needed.  Returns
+	 * the file descriptor and the offset of the table data, or -1.
+	 */
+	int openInPlace(const std::string &filename, const table_options &opt, off_t &data_offset);
+	bool save_compressed(FILE *fp, const std::vector<uint64_t> &sums, int n_threads) const;
 
 	void setPrune(decltype(index_t::prune) p);
+	void setPrune(alloc::block &&b);
+	void setRowOrder(table_options::row_order_t order);
 
 	std::vector<cube> getCornerRepresentatives() const;
 
 	uint8_t * getPruneRow(uint32_t corner_sym) {
-		return index[0].prune + corner_sym * stride;
+		return mem + row_pos[corner_sym] * stride;
 	}
 
 	uint16_t sym_coord(const cube &c) const {
@@ -344,21 +552,86 @@ class prune_base {
 
 	std::array<index_t, N_CORNER_SYM> index;
 
+	// Position in memory of each sym-coordinate row
+	std::array<uint16_t, N_CORNER_SYM> row_pos;
+	table_options::row_order_t row_order;
+	alloc::block table;
+	uint8_t *mem;
+
 	size_t stride;
+	uint32_t variant, base, encoding;
+	bool legacy_file;
+	bool compressed_file;
+	bool derived_table;
+	const corner_table *corners;
+};
+
+/* Encodings of the pruning table values.  Entries are stored in
+ * stripes of 64, by the low 6 bits of the edge coordinate; entries 0
+ * and 1 of each stripe are never used by a coordinate (see ecoord).
+ * ID is recorded in the table file header.
+ */
+
+/* 2 bits per entry: 1..3 stand for Base+1..Base+3 (3 meaning at least
+ * that), and 0 for the minimum of the stripe, which is kept in the 4 bits
+ * of the two unused entries.  16 bytes per stripe.
+ */
+struct encoding_2bit {
+	static constexpr uint32_t ID = 0;
+	static constexpr size_t STRIPE_BYTES = 16;
+
+	template<int Base>
+	static uint8_t fetch(const uint8_t *stripe, uint32_t edge) {
+		auto &octet = stripe[(edge / 4) % 16];
+		auto shift = (edge % 4) * 2;
+		auto val = (octet >> shift) & 3;
+		return val ? (Base + val) : (stripe[0] & 0xf);
+	}
+
+	/* The range of distances an entry stands for (0xff: no upper bound) */
+	template<int Base>
+	static std::pair<uint8_t, uint8_t> bounds(const uint8_t *stripe, uint32_t edge) {
+		auto &octet = stripe[(edge / 4) % 16];
+		auto val = (octet >> ((edge % 4) * 2)) & 3;
+		if (val == 0) {
+			return { stripe[0] & 0xf, Base };
+		}
+		return { Base + val, (val == 3) ? 0xff : Base + val };
+	}
+};
+
+/* The exact distance in 4 bits per entry (15 meaning at least 15), at
+ * twice the size of encoding_2bit.  Base is not used to store values
+ * (the solver still uses it to choose its search strategy.)  It is meant
+ * for the smaller tables, where the stronger bounds are worth the memory.
+ */
+struct encoding_exact {
+	static constexpr uint32_t ID = 4;
+	static constexpr size_t STRIPE_BYTES = 32;
+
+	template<int Base>
+	static uint8_t fetch(const uint8_t *stripe, uint32_t edge) {
+		return (stripe[(edge / 2) % 32] >> ((edge % 2) * 4)) & 0xf;
+	}
+
+	template<int Base>
+	static std::pair<uint8_t, uint8_t> bounds(const uint8_t *stripe, uint32_t edge) {
+		uint8_t val = fetch<Base>(stripe, edge);
+		return { val, (val == 0xf) ? 0xff : val };
+	}
 };
 
-template<typename ECoord, int Base>
+template<typename ECoord, int Base, typename Encoding = encoding_2bit>
 class prune : public prune_base {
 	template<typename Prune> friend class prune_generator;
+	template<typename Prune, typename Source> friend class prune_deriver;
+	template<typename Prune> friend class prune_checker;
 
 	struct prefetch_t {
 		uint32_t edge;
 		const uint8_t *stripe;
 		uint8_t fetch() const {
-			auto &octet = stripe[(edge / 4) % 16];
-			auto shift = (edge % 4) * 2;
-			auto val = (octet >> shift) & 3;
-			return val ? (BASE + val) : (stripe[0] & 0xf);
+			return Encoding::template fetch<Base>(stripe, edge);
 		}
 	};
 
@@ -366,17 +639,22 @@ class prune : public prune_base {
 		auto &idx = index[c.getCornerOrient()];
 		auto &os = idx.os[c.getCorner4Comb()];
 		auto edge = ECoord(c, os.sym);
-		auto stripe = &idx.prune[16 * (N_EDGE_STRIPE * os.offset + edge / 64)];
+		auto stripe = &idx.prune[STRIPE_BYTES * (N_EDGE_STRIPE * os.offset + edge / 64)];
 		_mm_prefetch(stripe, _MM_HINT_T0);
 		return { edge, stripe };
 	}
 
     public:
 	using ecoord = ECoord;
+	using encoding = Encoding;
 	static constexpr uint64_t N_EDGE_STRIPE = ecoord::N_ECOORD / 64;
+	static constexpr size_t STRIPE_BYTES = Encoding::STRIPE_BYTES;
 	static constexpr int BASE = Base;
 
-	prune() : prune_base(16 * N_EDGE_STRIPE) {
+	/* Same as size(), without constructing the index */
+	static constexpr size_t SIZE = STRIPE_BYTES * N_EDGE_STRIPE * N_CORNER_SYM;
+
+	prune() : prune_base(STRIPE_BYTES * N_EDGE_STRIPE, ecoord::ID, Base, Encoding::ID) {
 	}
 
 	uint8_t lookup(const cube6 &c6, uint8_t limit, uint32_t &prune_vals, int skip, int val, uint8_t &axis_mask) const {
@@ -388,6 +666,12 @@ class prune : public prune_base {
 		if (skip != 4) pre[4] = prefetch(c6[4]);
 		if (skip != 5) pre[5] = prefetch(c6[5]);
 
+		uint32_t corner_idx = 0;
+		if (corners) {
+			corner_idx = corner_table::index(c6[0]);
+			corners->prefetch(corner_idx);
+		}
+
 		uint8_t prune[6];
 		if (skip != 0xff) {
 			prune[skip] = val;
@@ -460,7 +744,12 @@ class prune : public prune_base {
 			((prune[4] == limit) << 4) |
 			((prune[5] == limit) << 5);
 
-		return (prune0 < prune1) ? prune1 : prune0;
+		uint8_t prune_max = (prune0 < prune1) ? prune1 : prune0;
+		if (corners) {
+			uint8_t prune_c = corners->get(corner_idx);
+			prune_max = (prune_max < prune_c) ? prune_c : prune_max;
+		}
+		return prune_max;
 	}
 
 	uint8_t initial_depth(const cube6 &c6) const {
@@ -469,9 +758,58 @@ class prune : public prune_base {
 		return lookup(c6, 0xff, prune_vals, -1, 0, axis_mask);
 	}
 
+	/* Same as initial_depth for each of "n" positions, but the table
+	 * stripes for a whole group of positions are prefetched before any
+	 * of them is read, keeping many cache misses in flight at once
+	 */
+	void lookup_many(const cube6 *c6, size_t n, uint8_t *depth) const {
+		constexpr size_t GROUP = 16;
+		prefetch_t pre[GROUP][6];
+		uint32_t corner_idx[GROUP];
+
+		for (size_t first = 0; first < n; first += GROUP) {
+			size_t len = std::min(GROUP, n - first);
+			for (size_t i = 0; i < len; i++) {
+				for (int j = 0; j < 6; j++) {
+					pre[i][j] = prefetch(c6[first + i][j]);
+				}
+				if (corners) {
+					corner_idx[i] = corner_table::index(c6[first + i][0]);
+					corners->prefetch(corner_idx[i]);
+				}
+			}
+
+			for (size_t i = 0; i < len; i++) {
+				uint8_t prune[6];
+				for (int j = 0; j < 6; j++) {
+					prune[j] = pre[i][j].fetch();
+				}
+				if (!(prune[0] | prune[1] | prune[2])) {
+					depth[first + i] = 0;
+					continue;
+				}
+
+				uint8_t d = std::max(max3(prune[0], prune[1], prune[2]), max3(prune[3], prune[4], prune[5]));
+				if (corners) {
+					d = std::max(d, corners->get(corner_idx[i]));
+				}
+				depth[first + i] = d;
+			}
+		}
+	}
+
     private:
-	void init(uint8_t *mem) {
-		setPrune(mem);
+	void init(alloc::block &&b) {
+		setPrune(std::move(b));
+	}
+
+	/* The bound from the three axes of one cube, as in lookup: one more
+	 * than the max if all three are equal
+	 */
+	static uint8_t max3(uint8_t a, uint8_t b, uint8_t c) {
+		uint32_t cmp = (1 << a) | (1 << b) | (1 << c);
+		cmp |= _blsi_u32(cmp) << 1;
+		return 31 - _lzcnt_u32(cmp);
 	}
 };
 
@@ -0,0 +1,237 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VCUBE_NXPRUNE_CHECKER_H
+#define VCUBE_NXPRUNE_CHECKER_H
+
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <vector>
+#include "nxprune.h"
+
+namespace vcube::nx {
+
+/* Checks a sample of pruning table entries against the distances they
+ * stand for.  Unlike the file checksums, this also catches a table that
+ * was damaged in memory or built wrong, before it silently gives wrong
+ * or non-optimal solutions.
+ *
+ * Half of the samples are random entries, rebuilt into a cube from the
+ * corner and edge representatives; the other half are the entries of
+ * short random move sequences, whose distances are small.  Each entry
+ * must agree with:
+ *   - the distance found by a bounded brute-force search, when the entry
+ *     is within reach of it (always, for the short sequences)
+ *   - the entries of its 18 neighbors, which are within one move of it
+ *     (at least one of them closer to solved)
+ *
+ * A derived table's entries are only lower bounds, so only the lower
+ * bound of each entry is checked.
+ */
+template<typename Prune>
+class prune_checker {
+	using ECoord = typename Prune::ecoord;
+	using Edges = typename ECoord::edges;
+	using Encoding = typename Prune::encoding;
+	using bounds_t = std::pair<uint8_t, uint8_t>;
+
+    public:
+	struct result_t {
+		uint64_t samples;  // entries checked
+		uint64_t searched; // entries whose distance the search found
+		uint64_t errors;   // entries that disagree
+	};
+
+	/* "max_depth" bounds the brute-force search; each depth costs
+	 * about 13 times the previous one
+	 */
+	prune_checker(Prune &P, int n_threads, int max_depth = 5) :
+		P(P), edge_rep(), corner_rep(P.getCornerRepresentatives()),
+		n_threads(std::max(1, n_threads)), max_depth(max_depth),
+		goal_row(P.sym_coord(cube())), goal_coord(ECoord(cube())), reported(0)
+	{
+		edge_rep.init<Edges>();
+	}
+
+	/* Checks entries until "max_samples" are done or "time_limit"
+	 * has passed.  The first few errors are reported on stderr.
+	 */
+	result_t check(std::chrono::duration<double> time_limit, uint64_t max_samples = UINT64_MAX) {
+		auto deadline = std::chrono::steady_clock::now() + time_limit;
+		std::atomic<uint64_t> next(0), samples(0), searched(0), errors(0);
+		std::random_device rd;
+		uint64_t seed = (uint64_t(rd()) << 32) | rd();
+
+		std::vector<std::thread> workers;
+		for (int i = 0; i < n_threads; i++) {
+			workers.push_back(std::thread([&, i]() {
+						std::mt19937_64 rng(seed + i);
+						for (uint64_t n; (n = next++) < max_samples; ) {
+							if (std::chrono::steady_clock::now() >= deadline) {
+								break;
+							}
+							bool found = false;
+							if (!((n & 1) ? checkWalk(rng, found) : checkEntry(rng, found))) {
+								errors++;
+							}
+							samples++;
+							searched += found;
+						}
+					}));
+		}
+		for (auto &t : workers) {
+			t.join();
+		}
+
+		return { samples, searched, errors };
+	}
+
+    private:
+	Prune &P;
+	ecoord_rep edge_rep;
+	std::vector<cube> corner_rep;
+	int n_threads;
+	int max_depth;
+	uint32_t goal_row, goal_coord;
+	std::atomic<int> reported;
+
+	static constexpr int MAX_REPORTS = 10;
+
+	/* A random table entry */
+	bool checkEntry(std::mt19937_64 &rng, bool &found) {
+		uint32_t row = rng() % N_CORNER_SYM, coord;
+		do {
+			coord = rng() % ECoord::N_ECOORD;
+			// Entries 0 and 1 of each stripe and 511 are unused (see ecoord)
+		} while ((coord % 64) < 2 || (coord % 512) == 511);
+
+		auto [ high, low, eo ] = Edges::decode(coord % Edges::N_ECOORD);
+		cube c = corner_rep[row];
+		c.setEdges(edge_rep.get<Edges>(high, low, eo));
+		if constexpr (ECoord::N_CP > 1) {
+			c = ECoord::setCP(c, coord / Edges::N_ECOORD);
+		}
+
+		// The representative must lead back to the same entry
+		auto stripe = P.getPruneRow(row) + Prune::STRIPE_BYTES * (coord / 64);
+		bounds_t b = bounds(stripe, coord);
+		if (P.sym_coord(c) != row || ECoord(c) != coord || lookup(c) != b) {
+			return report(row, coord, b, "does not match its representative");
+		}
+
+		// Out of reach of the search, unless the table is too high
+		int limit = (b.first <= max_depth) ? std::min<int>(b.second, max_depth) : -1;
+		return checkCube(c, row, coord, b, limit, found);
+	}
+
+	/* The entry of a short random move sequence */
+	bool checkWalk(std::mt19937_64 &rng, bool &found) {
+		int len = 1 + rng() % max_depth;
+		cube c;
+		for (int i = 0; i < len; i++) {
+			c = c.move(rng() % N_MOVES);
+		}
+		uint32_t row = P.sym_coord(c), coord = ECoord(c, P.get_sym(c));
+		return checkCube(c, row, coord, lookup(c), len, found);
+	}
+
+	bool checkCube(const cube &c, uint32_t row, uint32_t coord, bounds_t b, int limit, bool &found) {
+		if (limit >= 0) {
+			int d = distance(c, limit);
+			found = d <= limit;
+			if (found ? (d < b.first || d > b.second) : (b.second <= limit)) {
+				return report(row, coord, b, found ? "distance %d" : "distance over %d", found ? d : limit);
+			}
+		}
+
+		bool closer = false;
+		for (int m = 0; m < N_MOVES; m++) {
+			bounds_t bn = lookup(c.move(m));
+			if (b.first > bn.second + 1 || bn.first > b.second + 1) {
+				return report(row, coord, b, "neighbor %u..%u", bn.first, bn.second);
+			}
+			closer |= bn.first + 1 <= b.second;
+		}
+		if (b.second && !closer) {
+			return report(row, coord, b, "no neighbor is closer");
+		}
+		return true;
+	}
+
+	bounds_t lookup(const cube &c) const {
+		auto pre = P.prefetch(c);
+		return bounds(pre.stripe, pre.edge);
+	}
+
+	bounds_t bounds(const uint8_t *stripe, uint32_t edge) const {
+		bounds_t b = Encoding::template bounds<Prune::BASE>(stripe, edge);
+		if (P.derived()) {
+			b.second = 0xff;
+		}
+		return b;
+	}
+
+	bool isGoal(const cube &c) const {
+		return P.sym_coord(c) == goal_row && ECoord(c, P.get_sym(c)) == goal_coord;
+	}
+
+	/* The distance of the cube's coordinate if at most "limit",
+	 * otherwise limit + 1
+	 */
+	int distance(const cube &c, int limit) const {
+		int d = 0;
+		while (d <= limit && !search(c, d, -1)) {
+			d++;
+		}
+		return d;
+	}
+
+	bool search(const cube &c, int depth, int last_face) const {
+		if (depth == 0) {
+			return isGoal(c);
+		}
+		for (int m = 0; m < N_MOVES; m++) {
+			int face = m / 3;
+			// Skip same-face turns, and opposite faces in one order
+			if (face == last_face || face + 3 == last_face) {
+				continue;
+			}
+			if (search(c.move(m), depth - 1, face)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	template<typename... Args>
+	bool report(uint32_t row, uint32_t coord, bounds_t b, const char *what, Args... args) {
+		if (reported++ < MAX_REPORTS) {
+			char msg[64];
+			snprintf(msg, sizeof(msg), what, args...);
+			fprintf(stderr, "Table entry %u:%u (%u..%u): %s\n", row, coord, b.first, b.second, msg);
+		}
+		return false;
+	}
+};
+
+}
+
+#endif
@@ -22,6 +22,10 @@
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <string>
+#include <type_traits>
+#include <unistd.h>
 #include "nxprune.h"
 #include "alloc.h"
 
@@ -29,6 +33,13 @@ namespace vcube::nx {
 
 template<typename Prune>
 class prune_generator {
+	static constexpr bool EXACT = std::is_same_v<typename Prune::encoding, encoding_exact>;
+
+	// The edge part of the coordinate; a corner permutation part (see
+	// cpcoord) is moved with the corner representative of each row
+	using ECoord = typename Prune::ecoord;
+	using Edges = typename ECoord::edges;
+
 	struct neighbor_t {
 		uint16_t first, second;
 		mutable uint32_t moves, moves_inv;
@@ -45,17 +56,18 @@ class prune_generator {
 
     public:
 	prune_generator(Prune &P, int n_threads) :
-		P(P), edge_rep(), corner_prune(), n_threads(), mod3_next_xor(), mod3_mask(), depth_xor()
+		P(P), edge_rep(), corner_prune(), n_threads(), mod3_next_xor(), mod3_mask(), depth_xor(), frontier()
 	{
 		this->n_threads = std::max(1, n_threads);
-		edge_rep.init<typename Prune::ecoord>();
+		edge_rep.init<Edges>();
 	}
 
 	void generate() {
 		// Allocate the pruning table and initialize all to unvisited
-		auto mem = alloc::huge<uint8_t>(16 * Prune::N_EDGE_STRIPE * N_CORNER_SYM);
-		memset(mem, 0xff, 16 * Prune::N_EDGE_STRIPE * N_CORNER_SYM);
-		P.init(mem);
+		auto block = alloc::anonymous(P.size());
+		uint8_t *mem = block.get();
+		memset(mem, 0xff, P.size());
+		P.init(std::move(block));
 
 		// Neighbor tables
 		auto corner_rep = P.getCornerRepresentatives();
@@ -67,23 +79,30 @@ class prune_generator {
 		}
 
 		// Set the identity cube depth to zero
-		mem[0] = 0xc0;
-		uint64_t found = 1;
+		if (EXACT) {
+			mem[1] = 0xf0;
+		} else {
+			mem[0] = 0xc0;
+		}
+		uint64_t found = 1, prev_found = 0;
 
 		// Filter to speed up passes where the frontier is sparse
 		std::vector<uint8_t> dirty(N_CORNER_SYM, 255);
 		dirty[0] = 0;
 
-		for (int depth = 0; depth <= Prune::BASE + 1; depth++) {
+		// Exact tables are complete when a pass finds nothing new, or
+		// when only depth 15 (the unvisited value) would be left
+		for (int depth = 0; EXACT ? (found > prev_found && depth < 14) : (depth <= Prune::BASE + 1); depth++) {
 			// Upon reaching the pruning table base value, zero
 			// all visited positions.  This will leave two distinct
 			// values in the table, 0 (visited), and 3 (unvisited).
 			// The final two passes will fill in the 1 and 2 values.
-			if (depth == Prune::BASE) {
+			if (!EXACT && depth == Prune::BASE) {
 				zero_visited(mem);
 			}
 
-			auto prev_found = found;
+			prev_found = found;
+			frontier = depth;
 
 			// The initial passes set the values to (depth % 3); the
 			// final two passes set them to (depth - Prune::BASE)
@@ -93,8 +112,8 @@ class prune_generator {
 			// unvisited value, which is known to be 3
 			mod3_next_xor = ((mod3 + 1) % 3) ^ 3;
 
-			// Similarly, the stripe-min values are set by xoring
-			// with the known unvisited value of 0xf
+			// Similarly, the stripe-min values (and exact values)
+			// are set by xoring with the known unvisited value of 0xf
 			depth_xor = (depth + 1) ^ 0xf;
 
 			// This mask is used to quickly find values matching
@@ -110,6 +129,7 @@ class prune_generator {
 			std::vector<bool> busy(N_CORNER_SYM), done(neighbors.size());
 			for (int i = 0; i < n_threads; i++) {
 				workers.push_back(std::thread([&]() {
+					std::vector<uint32_t> cp_offset(ECoord::N_CP);
 					mtx.lock();
 					bool ok;
 					do {
@@ -150,8 +170,19 @@ class prune_generator {
 									auto c_m = c.move(m);
 									auto goalc = ccoord(c_m.symConjugate(P.get_sym(c_m)));
 									for (uint8_t sym = 0; sym < 16; sym++) {
-										if (ccoord(c_m.symConjugate(sym)) == goalc) {
-											this_found += generateCornerPair(v_src, v_dst, m, sym);
+										if (ccoord(c_m.symConjugate(sym)) != goalc) {
+											continue;
+										}
+										if constexpr (ECoord::N_CP > 1) {
+											for (uint32_t cp = 0; cp < ECoord::N_CP; cp++) {
+												auto c_cp = ECoord::setCP(c, cp).move(m).symConjugate(sym);
+												cp_offset[cp] = ECoord::getCP(c_cp) * Edges::N_ECOORD;
+											}
+										}
+										if constexpr (EXACT) {
+											this_found += generateCornerPairExact(v_src, v_dst, m, sym, cp_offset.data());
+										} else {
+											this_found += generateCornerPair(v_src, v_dst, m, sym, cp_offset.data());
 										}
 									}
 								}
@@ -191,6 +222,7 @@ class prune_generator {
 	uint8_t mod3_next_xor;
 	__m128i mod3_mask;
 	uint8_t depth_xor;
+	uint8_t frontier;
 
 	auto getNeighbors(const std::vector<cube> &corner_rep) {
 		std::set<neighbor_t> nset;
@@ -229,7 +261,11 @@ class prune_generator {
 		}
 	}
 
-	uint64_t generateCornerPair(__m128i *src, __m128i *dst, uint8_t m, uint8_t sym) {
+	/* Visits the neighbors, through move "m" and symmetry "sym", of the
+	 * frontier entries in row "src".  cp_offset gives the target
+	 * coordinate of each corner permutation part.
+	 */
+	uint64_t generateCornerPair(__m128i *src, __m128i *dst, uint8_t m, uint8_t sym, const uint32_t *cp_offset) {
 		uint64_t found = 0;
 		uint32_t stripe_idx = 0;
 		for (auto src_end = src + Prune::N_EDGE_STRIPE; src != src_end; src++, stripe_idx++) {
@@ -238,7 +274,8 @@ class prune_generator {
 				continue;
 			}
 
-			auto [ high, low, eo ] = Prune::ecoord::decode(stripe_idx << 6);
+			auto [ high, low, eo ] = Edges::decode((stripe_idx << 6) % Edges::N_ECOORD);
+			uint32_t cp_base = cp_offset[(stripe_idx << 6) / Edges::N_ECOORD];
 
 			auto cmp = _mm_xor_si128(*src, mod3_mask);
 			cmp = _mm_and_si128(cmp, _mm_srli_epi64(cmp, 1));
@@ -250,9 +287,9 @@ class prune_generator {
 				int b = _tzcnt_u64(bits);
 				bits = _blsr_u64(bits);
 
-				edgecube rep = edge_rep.get<typename Prune::ecoord>(high, low + b, eo);
+				edgecube rep = edge_rep.get<Edges>(high, low + b, eo);
 
-				typename Prune::ecoord coord(rep.move(m), sym);
+				uint32_t coord = cp_base + Edges(rep.move(m), sym);
 
 				auto s_d = (uint8_t *) &dst[coord / 64];
 				auto &s_octet = s_d[(coord / 4) % 16];
@@ -270,6 +307,225 @@ class prune_generator {
 
 		return found;
 	}
+
+	/* Same as generateCornerPair for encoding_exact, where the frontier
+	 * entries hold the current depth and unvisited ones hold 0xf
+	 */
+	uint64_t generateCornerPairExact(__m128i *src, __m128i *dst, uint8_t m, uint8_t sym, const uint32_t *cp_offset) {
+		uint64_t found = 0;
+		auto nibble = _mm256_set1_epi8(0xf);
+		auto depth = _mm256_set1_epi8(frontier);
+		auto s_src = (const uint8_t *) src;
+		auto s_dst = (uint8_t *) dst;
+		for (uint32_t stripe_idx = 0; stripe_idx < Prune::N_EDGE_STRIPE; stripe_idx++, s_src += 32) {
+			auto v = _mm256_loadu_si256((const __m256i *) s_src);
+			uint32_t even = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, nibble), depth));
+			uint32_t odd = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(_mm256_srli_epi16(v, 4), nibble), depth));
+			uint64_t bits = _pdep_u64(even, 0x5555555555555555) | _pdep_u64(odd, 0xaaaaaaaaaaaaaaaa);
+			if (!bits) {
+				continue;
+			}
+
+			auto [ high, low, eo ] = Edges::decode((stripe_idx << 6) % Edges::N_ECOORD);
+			uint32_t cp_base = cp_offset[(stripe_idx << 6) / Edges::N_ECOORD];
+			bits &= (low == 448) ? 0x7ffffffffffffffc : 0xfffffffffffffffc;
+			while (bits) {
+				int b = _tzcnt_u64(bits);
+				bits = _blsr_u64(bits);
+
+				edgecube rep = edge_rep.get<Edges>(high, low + b, eo);
+
+				uint32_t coord = cp_base + Edges(rep.move(m), sym);
+
+				auto &s_octet = s_dst[32 * (coord / 64) + (coord / 2) % 32];
+				auto s_shift = (coord % 2) * 4;
+				if (((s_octet >> s_shift) & 0xf) == 0xf) {
+					s_octet ^= depth_xor << s_shift;
+					found++;
+				}
+			}
+		}
+
+		return found;
+	}
+};
+
+/* Builds a pruning table by projecting a larger table onto it, for a
+ * Source whose edge coordinate determines this one's (e.g. 312 -> 212,
+ * or 208 -> 108.)  The distance of a projected position is the minimum
+ * over the positions that project to it, so taking the minimum of the
+ * source's lower bounds gives a valid table.  It is weaker than a
+ * generated one where the source only knows its stripe minimum.  The
+ * source is streamed from its file one row at a time.
+ */
+template<typename Prune, typename Source>
+class prune_deriver {
+	using EC = typename Prune::ecoord;
+	using ES = typename Source::ecoord;
+
+	static constexpr int EP_C = EC::ID / 100 - 1, EO_C = EC::ID % 100 / 4 - 1;
+	static constexpr int EP_S = ES::ID / 100 - 1, EO_S = ES::ID % 100 / 4 - 1;
+	static constexpr int EO_BITS[] = { 4, 8, 11 };
+
+    public:
+	/* True if the source coordinate determines the target's: EP4
+	 * contains EP2 and EP3, which contain EP1; EO12 contains EO4 and
+	 * EO8, but EO8 does not contain EO4.  Only plain edge coordinates
+	 * (without a cpcoord corner part) are supported.
+	 */
+	static constexpr bool VALID = EC::ID != ES::ID && EC::N_CP == 1 && ES::N_CP == 1 &&
+		(EP_S == EP_C || EP_C == EP1 || EP_S == EP4) &&
+		(EO_S == EO_C || EO_S == EO12);
+
+	prune_deriver(Prune &P, int n_threads) : P(P), n_threads(std::max(1, n_threads)), e_layer() {
+		// The E-layer edges of each 12C4 coordinate (with the gaps
+		// for the stripe minimums), or 0 for unused values
+		for (uint32_t mask = 0; mask < 4096; mask++) {
+			if (_popcnt32(mask) == 4) {
+				uint32_t ecomb = rank_12C4(mask);
+				e_layer[ecomb + (ecomb + 63) * 33 / 2048 * 2] = mask;
+			}
+		}
+	}
+
+	bool derive(const std::string &source_filename, const table_options &opt) {
+		static_assert(VALID, "the source table does not determine this one");
+
+		Source S;
+		off_t data_offset;
+		int fd = S.openInPlace(source_filename, opt, data_offset);
+		if (fd == -1) {
+			return false;
+		}
+
+		P.init(alloc::anonymous(P.size()));
+		P.derived_table = true;
+
+		auto t0 = std::chrono::steady_clock::now();
+		std::atomic<uint32_t> next_row(0), done(0);
+		std::atomic<bool> ok(true);
+		std::mutex mtx;
+		std::vector<std::thread> workers;
+		for (int i = 0; i < n_threads; i++) {
+			workers.push_back(std::thread([&]() {
+				// Aligned for O_DIRECT
+				auto src = static_cast<uint8_t *>(aligned_alloc(4096, S.stride));
+				std::vector<uint8_t> bound(EC::N_ECOORD);
+				for (uint32_t row; ok && src && (row = next_row++) < N_CORNER_SYM; ) {
+					off_t off = data_offset + off_t(S.row_pos[row]) * S.stride;
+					for (size_t got = 0; got < S.stride; ) {
+						ssize_t n = pread(fd, src + got, S.stride - got, off + got);
+						if (n <= 0) {
+							ok = false;
+							break;
+						}
+						got += n;
+					}
+					project(src, bound.data());
+					encode(bound.data(), P.getPruneRow(row));
+
+					std::lock_guard<std::mutex> lock(mtx);
+					if (++done % 256 == 0 || done == N_CORNER_SYM) {
+						std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+						fprintf(stderr, "derive: %u/%u rows (%.06f)\n", uint32_t(done), N_CORNER_SYM, elapsed.count());
+					}
+				}
+				ok = ok && src;
+				free(src);
+			}));
+		}
+		for (auto &t : workers) {
+			t.join();
+		}
+		close(fd);
+
+		return ok;
+	}
+
+    private:
+	Prune &P;
+	int n_threads;
+	std::array<uint16_t, 512> e_layer;
+
+	/* The target coordinate of a source coordinate */
+	uint32_t project(uint32_t coord) const {
+		auto [ high, ecomb, eo ] = ES::decode(coord);
+
+		if (EP_C == EP1) {
+			high = 0;
+		} else if (EP_S == EP4 && EP_C == EP2) {
+			high %= N_E4PERM;
+		} else if (EP_S == EP4 && EP_C == EP3) {
+			high /= N_E4PERM;
+		}
+
+		if (EO_C != EO_S) {
+			// Only EO12 is projected; restore its implied 12th bit
+			uint32_t eo12 = eo | ((_popcnt32(eo) & 1) << 11);
+			if (EO_C == EO4) {
+				eo = _pext_u32(eo12, e_layer[ecomb]);
+			} else {
+				eo = _pext_u32(eo12, e_layer[ecomb] ^ 0xfff);
+			}
+		}
+
+		return (((high << EO_BITS[EO_C]) | eo) << 9) | ecomb;
+	}
+
+	/* Minimum of the source lower bounds over each target coordinate
+	 * of one row
+	 */
+	void project(const uint8_t *src, uint8_t *bound) const {
+		memset(bound, 0xff, EC::N_ECOORD);
+		for (uint64_t stripe = 0; stripe < Source::N_EDGE_STRIPE; stripe++) {
+			auto s = src + Source::STRIPE_BYTES * stripe;
+			for (uint32_t i = 2; i < 64; i++) {
+				uint32_t coord = (stripe << 6) | i;
+				if (!e_layer[coord & 0x1ff]) {
+					continue;
+				}
+				uint8_t lb = Source::encoding::template fetch<Source::BASE>(s, i);
+				auto &b = bound[project(coord)];
+				b = std::min(b, lb);
+			}
+		}
+	}
+
+	/* Packs the lower bounds of one row into stripes as the generator
+	 * leaves them: for encoding_2bit, values above Base as 1..3, others
+	 * as 0 with the stripe minimum
+	 */
+	void encode(const uint8_t *bound, uint8_t *dst) const {
+		if constexpr (std::is_same_v<typename Prune::encoding, encoding_exact>) {
+			for (uint32_t i = 0; i < EC::N_ECOORD; i += 2) {
+				uint8_t lo = e_layer[i & 0x1ff] ? std::min<uint8_t>(bound[i], 0xf) : 0xf;
+				uint8_t hi = e_layer[(i + 1) & 0x1ff] ? std::min<uint8_t>(bound[i + 1], 0xf) : 0xf;
+				dst[i / 2] = lo | (hi << 4);
+			}
+			return;
+		}
+
+		for (uint64_t stripe = 0; stripe < Prune::N_EDGE_STRIPE; stripe++) {
+			auto d = dst + 16 * stripe;
+			auto b = bound + 64 * stripe;
+			uint32_t low = (stripe << 6) & 0x1ff;
+			uint8_t min = 0xf;
+			memset(d, 0, 16);
+			for (uint32_t i = 2; i < 64; i++) {
+				uint8_t val = 3;
+				if (e_layer[low + i]) {
+					if (b[i] > Prune::BASE) {
+						val = std::min(b[i] - Prune::BASE, 3);
+					} else {
+						val = 0;
+						min = std::min(min, b[i]);
+					}
+				}
+				d[i / 4] |= val << (i % 4 * 2);
+			}
+			d[0] |= min;
+		}
+	}
 };
 
 }
@@ -17,6 +17,9 @@
  */
 
 #include <set>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include "nxsolve.h"
 
 using namespace vcube;
@@ -44,3 +47,182 @@ void solver_base::init() {
 
 	prev.swap(depth4);
 }
+
+std::vector<moveseq_t> solver_base::prefixes(int len) {
+	std::set<cube> seen = { cube() };
+	std::vector<std::pair<cube, moveseq_t>> prev = { { cube(), {} } }, next;
+
+	for (int depth = 0; depth < len; depth++) {
+		next.clear();
+		for (const auto &q : prev) {
+			for (int m = 0; m < N_MOVES; m++) {
+				cube c = q.first.move(m);
+				if (seen.insert(c).second) {
+					next.emplace_back(c, q.second);
+					next.back().second.push_back(m);
+				}
+			}
+		}
+		prev.swap(next);
+	}
+
+	std::vector<moveseq_t> result;
+	for (auto &q : prev) {
+		result.push_back(std::move(q.second));
+	}
+	return result;
+}
+
+namespace {
+	struct checkpoint_header_t {
+		char magic[8];
+		uint32_t version;
+		int32_t limit;
+		uint32_t depth;
+		uint32_t position;
+		uint64_t n_expands;
+		uint64_t n_lookups;
+		uint32_t n_order;
+		uint32_t reserved;
+	};
+
+	constexpr char CHECKPOINT_MAGIC[8] = "vcckpt";
+	constexpr uint32_t CHECKPOINT_VERSION = 2;
+}
+
+bool solver_base::checkpoint_t::save(const std::string &filename) const {
+	checkpoint_header_t h = {};
+	memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+	h.version = CHECKPOINT_VERSION;
+	h.limit = limit;
+	h.depth = depth;
+	h.position = position;
+	h.n_expands = n_expands;
+	h.n_lookups = n_lookups;
+	h.n_order = order.size();
+
+	// Write to a temporary file so an interrupted save never
+	// clobbers the previous checkpoint
+	auto tmpname = filename + ".tmp";
+	FILE *fp = fopen(tmpname.c_str(), "w");
+	if (!fp) {
+		return false;
+	}
+	bool ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+		fwrite(&c, sizeof(c), 1, fp) == 1 &&
+		fwrite(order.data(), sizeof(order_t), order.size(), fp) == order.size();
+	if (fclose(fp) || !ok) {
+		return false;
+	}
+	return rename(tmpname.c_str(), filename.c_str()) == 0;
+}
+
+bool solver_base::checkpoint_t::load(const std::string &filename) {
+	FILE *fp = fopen(filename.c_str(), "r");
+	if (!fp) {
+		return false;
+	}
+
+	checkpoint_header_t h;
+	bool ok = fread(&h, sizeof(h), 1, fp) == 1 &&
+		!memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) &&
+		h.version == CHECKPOINT_VERSION &&
+		h.n_order <= 0x10000 &&
+		fread(&c, sizeof(c), 1, fp) == 1;
+	if (ok) {
+		order.resize(h.n_order);
+		ok = fread(order.data(), sizeof(order_t), order.size(), fp) == order.size();
+	}
+	fclose(fp);
+
+	// queue_search indexes the depth-4 queue with these, so anything
+	// but a permutation of it (a damaged file, or one written by a
+	// different build) is not resumable
+	if (ok && !order.empty()) {
+		std::vector<bool> seen(depth4.size());
+		ok = order.size() == depth4.size() && h.position <= order.size();
+		for (size_t i = 0; ok && i < order.size(); i++) {
+			ok = order[i].idx < seen.size() && !seen[order[i].idx];
+			if (ok) {
+				seen[order[i].idx] = true;
+			}
+		}
+	}
+
+	if (ok) {
+		limit = h.limit;
+		depth = h.depth;
+		position = h.position;
+		n_expands = h.n_expands;
+		n_lookups = h.n_lookups;
+	}
+
+	return ok;
+}
+
+uint64_t solver_base::unit_t::hash(const cube &c) {
+	// FNV-1a of the Reid notation, which does not depend on the build
+	uint64_t h = 0xcbf29ce484222325;
+	for (char ch : c.to_reid()) {
+		h = (h ^ uint8_t(ch)) * 0x100000001b3;
+	}
+	return h;
+}
+
+std::string solver_base::unit_t::to_string(moveseq_t::style_t style) const {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%016lx %s %u ", cube_hash, prefix.to_string(moveseq_t::FIXED).c_str(), depth);
+	if (!found) {
+		return buf + std::string("-");
+	}
+	return buf + std::to_string(solution.size()) + " " + solution.to_string(style);
+}
+
+bool solver_base::unit_t::parse(const std::string &line) {
+	char prefix_s[64], len[8];
+	int n;
+	if (sscanf(line.c_str(), "%lx %63s %u %7s %n", &cube_hash, prefix_s, &depth, len, &n) != 4) {
+		return false;
+	}
+	prefix = moveseq_t::parse(prefix_s);
+	found = strcmp(len, "-");
+	solution = found ? moveseq_t::parse(line.substr(n)) : moveseq_t();
+	return !found || solution.size() == strtoul(len, NULL, 10);
+}
+
+const char * solver_base::merge_t::add(const unit_t &u) {
+	if (seen.empty()) {
+		cube_hash = u.cube_hash;
+		prefix_len = u.prefix.size();
+		depth = u.depth;
+	} else if (u.cube_hash != cube_hash) {
+		return "unit of a different cube";
+	} else if (u.prefix.size() != prefix_len) {
+		return "unit of a different split length";
+	} else if (u.depth != depth) {
+		return "unit searched to a different depth";
+	}
+
+	seen.insert(u.prefix);
+	if (u.found && (!found || u.solution.size() < best.size())) {
+		best = u.solution;
+		found = true;
+	}
+	return nullptr;
+}
+
+size_t solver_base::merge_t::n_units() const {
+	return prefixes(prefix_len).size();
+}
+
+bool solver_base::merge_t::complete() const {
+	if (seen.empty()) {
+		return false;
+	}
+	for (auto &p : prefixes(prefix_len)) {
+		if (!seen.count(p)) {
+			return false;
+		}
+	}
+	return true;
+}
@@ -16,9 +16,16 @@
  * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#ifndef VCUBE_NXSOLVE_H
+#define VCUBE_NXSOLVE_H
+
 #include "cube6.h"
+#include <set>
 #include <vector>
+#include <string>
+#include <chrono>
 #include <utility>
+#include <unistd.h>
 
 /* The nxprune table is an inconsistent heuristic, so Bidirectional PathMax
  * can offer additional pruning opportunities.  The reduction in node
@@ -44,19 +51,112 @@ class solver_base {
 		}
 	};
 
+	struct order_t {
+		uint16_t idx;
+		uint16_t density;
+		order_t() : idx(), density() {
+		}
+		order_t(uint16_t idx, uint16_t density) : idx(idx), density(density) {
+		}
+	};
+
 	// List of all cubes at depth=4
 	static std::vector<queue_t> depth4;
 
     public:
 	static void init();
+
+	/* Returns one move sequence for each position at exactly the given
+	 * distance from solved.  Every solution at least this long begins
+	 * with one of these prefixes (up to the choice of sequence reaching
+	 * the same position), so the subtrees below them partition the search
+	 */
+	static std::vector<moveseq_t> prefixes(int len);
+
+	/* Saved progress of a single solve.  During the iterative deepening
+	 * phase, only the depth is recorded; once the search moves on to
+	 * queue_search, the position within the depth-4 queue and the queue
+	 * ordering (including the densities measured so far at the current
+	 * depth) are recorded as well, which is enough to resume exactly.
+	 */
+	struct checkpoint_t {
+		cube c;
+		int32_t limit;
+		uint32_t depth;
+		uint32_t position;
+		uint64_t n_expands;
+		uint64_t n_lookups;
+		std::vector<order_t> order;
+
+		checkpoint_t() : c(), limit(), depth(), position(), n_expands(), n_lookups(), order() {
+		}
+
+		bool save(const std::string &filename) const;
+
+		/* A queue_search checkpoint loads only if its ordering is a
+		 * permutation of the depth-4 queue (so init() must come first)
+		 * and its position lies within it
+		 */
+		bool load(const std::string &filename);
+	};
+
+	/* Result of one work unit of a split solve (vc-optimal --unit): the
+	 * shortest solution beginning with the prefix, of at most "depth"
+	 * moves.  The cube is identified by a hash of its state, so units of
+	 * different cubes are not merged.
+	 */
+	struct unit_t {
+		uint64_t cube_hash;
+		moveseq_t prefix;
+		uint32_t depth;
+		bool found;
+		moveseq_t solution;
+
+		unit_t() : cube_hash(), prefix(), depth(), found(), solution() {
+		}
+
+		static uint64_t hash(const cube &c);
+
+		/* "HASH PREFIX DEPTH LEN SOLUTION", or "HASH PREFIX DEPTH -" */
+		std::string to_string(moveseq_t::style_t style = moveseq_t::SINGMASTER) const;
+		bool parse(const std::string &line);
+	};
+
+	/* Combines the results of the work units of one split solve.  Once
+	 * every prefix of the split is present, the shortest solution among
+	 * them is optimal (up to the depth.)
+	 */
+	struct merge_t {
+		std::set<moveseq_t> seen;
+		uint64_t cube_hash;
+		size_t prefix_len;
+		uint32_t depth;
+		bool found;
+		moveseq_t best;
+
+		merge_t() : seen(), cube_hash(), prefix_len(), depth(), found(), best() {
+		}
+
+		/* Returns nullptr, or why the unit does not belong with the
+		 * units added before (a different cube, prefix length or depth)
+		 */
+		const char * add(const unit_t &u);
+
+		size_t n_units() const;
+		bool complete() const;
+	};
 };
 
 template<typename prune_t>
 class solver : public solver_base {
-	uint64_t n_expands;
+	uint64_t n_expands, n_lookups;
 	uint8_t moves[20], *movep;
 	prune_t &P;
 
+	std::string ck_filename;
+	std::chrono::steady_clock::duration ck_interval;
+	std::chrono::steady_clock::time_point ck_next;
+
 	// Lookup table for expanding a 3-bit axis mask into a move list
 	static constexpr uint32_t axis_mask_expand[] = {
 		0777777, 0770770, 0707707, 0700700,
@@ -69,37 +169,133 @@ class solver : public solver_base {
 	static constexpr uint8_t NO_FACE = 6;
 
     public:
-	solver(prune_t &P) : P(P), n_expands(), moves(), movep(moves) {
+	solver(prune_t &P) : P(P), n_expands(), n_lookups(), moves(), movep(moves), ck_filename(), ck_interval(), ck_next() {
+	}
+
+	/* Periodically save progress to a file while solving.  If the file
+	 * already holds a checkpoint for the same cube and depth limit, the
+	 * next solve resumes from it.  The file is removed once the solve
+	 * completes.  An empty filename disables checkpointing.
+	 */
+	void set_checkpoint(const std::string &filename, std::chrono::seconds interval = std::chrono::seconds(60)) {
+		ck_filename = filename;
+		ck_interval = interval;
 	}
 
 	auto solve(const cube6 &c6, int limit = 20) {
 		movep = moves;
 		n_expands = 0;
+		n_lookups = 0;
+
+		checkpoint_t ck;
+		bool resume = !ck_filename.empty() && ck.load(ck_filename) &&
+			ck.c == c6[0] && ck.limit == limit && int(ck.depth) <= limit;
+		if (resume) {
+			n_expands = ck.n_expands;
+			n_lookups = ck.n_lookups;
+		}
+		ck_next = std::chrono::steady_clock::now() + ck_interval;
 
 		uint8_t len = 0xff;
 		auto limit1 = std::min(limit, prune_t::BASE + 4);
-		for (int d = P.initial_depth(c6); d <= limit1; d++) {
-			if (!search(c6, d, NO_FACE, NO_FACE, 0xff, 0)) {
-				len = d;
-				break;
+		if (!resume || ck.order.empty()) {
+			int d = P.initial_depth(c6);
+			if (resume) {
+				d = std::max(d, int(ck.depth));
+			}
+			for (; d <= limit1; d++) {
+				checkpoint(c6, limit, d);
+				if (!search(c6, d, NO_FACE, NO_FACE, 0xff, 0)) {
+					len = d;
+					break;
+				}
 			}
 		}
 
 		if (len == 0xff) {
-			len = queue_search(c6, prune_t::BASE + 5, limit);
+			len = queue_search(c6, prune_t::BASE + 5, limit, (resume && !ck.order.empty()) ? &ck : nullptr);
 			if (len == 0xff) {
 				len = 0;
 			}
 		}
 
+		if (!ck_filename.empty()) {
+			unlink(ck_filename.c_str());
+		}
+
 		return get_moves(len);
 	}
 
+	/* Solve only the subtree below a fixed sequence of opening moves,
+	 * searching for solutions up to "limit" moves long (including the
+	 * prefix.)  Returns false if there is no such solution.
+	 */
+	bool solve_prefix(const cube6 &c6, const moveseq_t &prefix, moveseq_t &solution, int limit = 20) {
+		n_expands = 0;
+		n_lookups = 0;
+
+		cube6 c6_p = c6;
+		for (auto m : prefix) {
+			c6_p = c6_p.move(m);
+		}
+
+		for (int d = P.initial_depth(c6_p) + prefix.size(); d <= limit; d++) {
+			if (search_prefix(c6, prefix, d, solution)) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	/* Single iteration of solve_prefix: searches only for solutions of
+	 * exactly "depth" moves (including the prefix.)  Does not reset the
+	 * cost counter, so it accumulates across calls.
+	 */
+	bool search_prefix(const cube6 &c6, const moveseq_t &prefix, int depth, moveseq_t &solution) {
+		movep = moves;
+
+		cube6 c6_p = c6;
+		uint8_t last_face = NO_FACE;
+		for (auto m : prefix) {
+			c6_p = c6_p.move(m);
+			last_face = m / 3;
+		}
+
+		int d = depth - prefix.size();
+		if (d < 0 || search(c6_p, d, last_face, NO_FACE, 0xff, 0)) {
+			return false;
+		}
+
+		solution = prefix;
+		auto rest = get_moves(d);
+		solution.insert(solution.end(), rest.begin(), rest.end());
+		return true;
+	}
+
+	/* Returns the cost of a single search iteration "extra" moves past
+	 * the pruning table lower bound.  This is a cheap predictor of how
+	 * expensive a full solve will be.
+	 */
+	uint64_t probe(const cube6 &c6, int extra = 1) {
+		movep = moves;
+		n_expands = 0;
+		n_lookups = 0;
+		int d = std::min(P.initial_depth(c6) + extra, 20);
+		search(c6, d, NO_FACE, NO_FACE, 0xff, 0);
+		return n_expands;
+	}
+
 	/* Returns the cost of the previous solve */
 	uint64_t cost() const {
 		return n_expands;
 	}
 
+	/* Returns the number of pruning table lookups in the previous solve */
+	uint64_t lookups() const {
+		return n_lookups;
+	}
+
     private:
 	uint8_t search(const cube6 &c6, uint8_t max_depth, uint8_t last_face, uint8_t last_face_r, int skip, int val) {
 		if (max_depth == 0) {
@@ -108,6 +304,7 @@ class solver : public solver_base {
 
 		uint32_t prune_vals;
 		uint8_t axis_mask;
+		n_lookups++;
 		uint8_t prune = P.lookup(c6, max_depth, prune_vals, skip, val, axis_mask);
 		if (prune > max_depth) {
 			return prune;
@@ -187,24 +384,49 @@ class solver : public solver_base {
 		return prune + !prune;
 	}
 
-	uint8_t queue_search(const cube6 &c6, uint8_t depth, int limit) {
+	/* Save a checkpoint if checkpointing is enabled and the interval
+	 * has elapsed since the last one
+	 */
+	void checkpoint(const cube6 &c6, int limit, uint8_t depth, uint32_t position = 0, const std::vector<order_t> *order = nullptr) {
+		if (ck_filename.empty()) {
+			return;
+		}
+		auto now = std::chrono::steady_clock::now();
+		if (now < ck_next) {
+			return;
+		}
+		ck_next = now + ck_interval;
+
+		checkpoint_t ck;
+		ck.c = c6[0];
+		ck.limit = limit;
+		ck.depth = depth;
+		ck.position = position;
+		ck.n_expands = n_expands;
+		ck.n_lookups = n_lookups;
+		if (order) {
+			ck.order = *order;
+		}
+		ck.save(ck_filename);
+	}
+
+	uint8_t queue_search(const cube6 &c6, uint8_t depth, int limit, const checkpoint_t *resume) {
 		std::vector<queue_t> queue;
 
 		for (const auto &q : depth4) {
 			queue.emplace_back(c6 * q.c6, q.moves, q.last_face);
 		}
 
-		struct order_t {
-			uint16_t idx;
-			uint16_t density;
-			order_t() : idx(), density() {
-			}
-			order_t(uint16_t idx, uint16_t density) : idx(idx), density(density) {
-			}
-		};
 		std::vector<order_t> order, order_new;
-		for (int i = 0; i < queue.size(); i++) {
-			order.emplace_back(i, 0);
+		size_t start = 0;
+		if (resume && resume->order.size() == queue.size()) {
+			order = resume->order;
+			depth = resume->depth;
+			start = resume->position;
+		} else {
+			for (int i = 0; i < queue.size(); i++) {
+				order.emplace_back(i, 0);
+			}
 		}
 		order_new.resize(order.size());
 
@@ -214,7 +436,17 @@ class solver : public solver_base {
 		for (auto d = depth; d <= limit; d++) {
 			hist0.fill(0);
 			hist1.fill(0);
-			for (auto &o : order) {
+
+			// When resuming, the densities up to the checkpoint
+			// position were already measured at this depth
+			for (size_t i = 0; i < start; i++) {
+				hist0[order[i].density & 0xff]++;
+				hist1[order[i].density >> 8]++;
+			}
+
+			for (size_t i = start; i < order.size(); i++) {
+				checkpoint(c6, limit, d, i, &order);
+				auto &o = order[i];
 				auto &q = queue[o.idx];
 				auto old_cost = cost();
 				auto prune = search(q.c6, d - 4, q.last_face, NO_FACE, -1, 0);
@@ -237,6 +469,7 @@ class solver : public solver_base {
 				hist0[o.density & 0xff]++;
 				hist1[o.density >> 8]++;
 			}
+			start = 0;
 
 			uint16_t sum0 = 0, sum1 = 0;
 			for (int i = 0; i < 256; i++) {
@@ -272,3 +505,5 @@ class solver : public solver_base {
 };
 
 }
+
+#endif
@@ -0,0 +1,198 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VCUBE_NXVARIANT_H
+#define VCUBE_NXVARIANT_H
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "nxprune.h"
+
+namespace vcube::nx {
+
+/* A pruning table variant as a type, as passed by for_each_variant.
+ * "Preferred" marks the base chosen for the coordinate; the others are
+ * selected with --base.
+ */
+template<typename ECoord, int Base, typename Encoding = encoding_2bit, bool Preferred = true>
+struct variant_type {
+	using prune = nx::prune<ECoord, Base, Encoding>;
+	static constexpr bool PREFERRED = Preferred;
+	static constexpr bool EXACT = std::is_same_v<Encoding, encoding_exact>;
+};
+
+template<EPvariant EP, EOvariant EO, int Base, bool Preferred = true, typename Encoding = encoding_2bit>
+using edge_variant = variant_type<ecoord<EP, EO>, Base, Encoding, Preferred>;
+
+/* Calls fn(variant_type<...>()) for each table variant the programs are
+ * built with.
+ *
+ * Each 2-bit variant is built with its chosen base (from vc-tune), and
+ * one on either side, which --base selects without rebuilding.  The
+ * largest variants (510 GiB and 4 TiB) have no base chosen yet, so
+ * --base is required for them.  Some variants are commented out because
+ * they are too slow and unnecessarily increase code size by instantiting
+ * templates that will see little use.
+ */
+template<typename Fn>
+void for_each_variant(Fn &&fn) {
+	//fn(edge_variant<EP1, EO4,   7>());
+	//fn(edge_variant<EP1, EO8,   8>());
+	fn(edge_variant<EP1, EO12,  8, false>());
+	fn(edge_variant<EP1, EO12,  9>());
+	fn(edge_variant<EP1, EO12, 10, false>());
+
+	//fn(edge_variant<EP2, EO4,   8>());
+	fn(edge_variant<EP2, EO8,   8, false>());
+	fn(edge_variant<EP2, EO8,   9>());
+	fn(edge_variant<EP2, EO8,  10, false>());
+	fn(edge_variant<EP2, EO12,  9, false>());
+	fn(edge_variant<EP2, EO12, 10>());
+	fn(edge_variant<EP2, EO12, 11, false>());
+
+	fn(edge_variant<EP3, EO4,   7, false>());
+	fn(edge_variant<EP3, EO4,   8>());
+	fn(edge_variant<EP3, EO4,   9, false>());
+	fn(edge_variant<EP3, EO8,   9, false>());
+	fn(edge_variant<EP3, EO8,  10>());
+	fn(edge_variant<EP3, EO8,  11, false>());
+	fn(edge_variant<EP3, EO12,  9, false>());
+	fn(edge_variant<EP3, EO12, 10>()); // base 11 reduces lookups by 0.2%
+	fn(edge_variant<EP3, EO12, 11, false>());
+
+	fn(edge_variant<EP4, EO4,   9, false>());
+	fn(edge_variant<EP4, EO4,  10>());
+	fn(edge_variant<EP4, EO4,  11, false>());
+	fn(edge_variant<EP4, EO8,  11, false>());
+	fn(edge_variant<EP4, EO8,  12, false>());
+	fn(edge_variant<EP4, EO12, 11, false>());
+	fn(edge_variant<EP4, EO12, 12, false>());
+
+	// Exact-distance tables (--exact), twice the size.  The base only
+	// sets the depth where the search switches to queue_search.
+	fn(edge_variant<EP1, EO4,   7, true, encoding_exact>());
+	fn(edge_variant<EP1, EO8,   8, true, encoding_exact>());
+	fn(edge_variant<EP1, EO12,  9, true, encoding_exact>());
+	fn(edge_variant<EP2, EO4,   8, true, encoding_exact>());
+	fn(edge_variant<EP2, EO8,   9, true, encoding_exact>());
+
+	// Edge coordinates combined with the U/D-face corner order (1xxx,
+	// 36 times the size)
+	fn(variant_type<cpcoord<ecoord<EP1, EO4>>, 7, encoding_2bit, false>());
+	fn(variant_type<cpcoord<ecoord<EP1, EO4>>, 8>());
+	fn(variant_type<cpcoord<ecoord<EP1, EO4>>, 9, encoding_2bit, false>());
+}
+
+/* What the programs know about a table variant at run time */
+struct table_variant {
+	int id;               // coordinate variant, e.g. 308
+	bool exact;           // encoding_exact
+	int base;
+	bool preferred;       // the base used unless --base is given
+	std::string filename; // relative to the program's directory
+	uint32_t shm_key;     // SysV shared memory key
+	size_t size;          // table size in bytes
+
+	bool operator < (const table_variant &o) const {
+		return size < o.size;
+	}
+
+	template<typename Variant>
+	static table_variant make() {
+		using Prune = typename Variant::prune;
+		constexpr int id = Prune::ecoord::ID, base = Prune::BASE;
+		constexpr int cp = id / 1000, ep = id / 100 % 10, eo = id % 100;
+		constexpr bool exact = Variant::EXACT;
+		char filename[64];
+		if (cp) {
+			sprintf(filename, "tables/nxprune_cp%d_%d_%02d_%02d%s.dat",
+					cp, ep, eo, base, exact ? "_exact" : "");
+		} else {
+			sprintf(filename, "tables/nxprune_%d_%02d_%02d%s.dat",
+					ep, eo, base, exact ? "_exact" : "");
+		}
+		uint32_t shm_key = 0x76630000 |
+			(exact ? 0x4000 : 0) |
+			(cp << 12) |
+			(base << 8) |
+			(ep << 4) |
+			eo;
+		return { id, exact, base, Variant::PREFERRED, filename, shm_key, Prune::SIZE };
+	}
+};
+
+/* The variant of a program's list with the given coordinate, encoding
+ * and base (0 for the chosen one), or nullptr
+ */
+template<typename Variant>
+Variant * find_variant(std::vector<Variant> &variants, int id, bool exact, int base) {
+	for (auto &v : variants) {
+		if (v.id == id && v.exact == exact && (base ? v.base == base : v.preferred)) {
+			return &v;
+		}
+	}
+	return nullptr;
+}
+
+/* The bases a variant is built with, e.g. "base 10 [9-11]" for a chosen
+ * base of 10, or "" if the variant is not built
+ */
+template<typename Variant>
+std::string variant_bases(const std::vector<Variant> &variants, int id, bool exact) {
+	int preferred = 0, lo = INT_MAX, hi = 0;
+	for (auto &v : variants) {
+		if (v.id == id && v.exact == exact) {
+			preferred = v.preferred ? v.base : preferred;
+			lo = std::min(lo, v.base);
+			hi = std::max(hi, v.base);
+		}
+	}
+
+	char s[32];
+	if (!hi) {
+		return "";
+	} else if (lo == hi) {
+		snprintf(s, sizeof(s), "base %d", lo);
+	} else if (preferred) {
+		snprintf(s, sizeof(s), "base %d [%d-%d]", preferred, lo, hi);
+	} else {
+		snprintf(s, sizeof(s), "base %d-%d", lo, hi);
+	}
+	return s;
+}
+
+/* Reports why find_variant found nothing */
+template<typename Variant>
+void report_missing_variant(const std::vector<Variant> &variants, int id, bool exact, int base) {
+	std::string bases = variant_bases(variants, id, exact);
+	if (bases.empty()) {
+		fprintf(stderr, "Unsupported edge coordinate '%d'%s\n", id, exact ? " with --exact" : "");
+	} else if (base) {
+		fprintf(stderr, "Variant %d is not built with base %d (%s)\n", id, base, bases.c_str());
+	} else {
+		fprintf(stderr, "Variant %d has no chosen base; give one with --base (%s)\n", id, bases.c_str());
+	}
+}
+
+}
+
+#endif
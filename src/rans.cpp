@@ -0,0 +1,230 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <array>
+#include <cstring>
+#include "rans.h"
+
+using namespace vcube;
+
+namespace {
+
+constexpr uint32_t PROB_BITS = 14;
+constexpr uint32_t PROB_SCALE = 1 << PROB_BITS;
+constexpr uint32_t RANS_L = 1 << 16; // lower bound of the normalized state
+
+/* Symbols are coded round-robin with independent states, so the decoder
+ * can overlap their dependency chains.  States are renormalized 16 bits
+ * at a time, which needs at most one (branch-free) read per symbol.
+ */
+constexpr int N_STATES = 4;
+
+/* The stream is padded so the decoder may load a whole group's worth of
+ * words without bounds checks
+ */
+constexpr size_t PADDING = 2 * N_STATES;
+
+enum mode_t : uint8_t { MODE_RAW, MODE_RANS };
+
+/* Scale symbol counts to frequencies summing to PROB_SCALE, keeping every
+ * symbol that occurs at a frequency of at least 1
+ */
+std::array<uint32_t, 256> normalize(const std::array<uint64_t, 256> &count, size_t n) {
+	std::array<uint32_t, 256> freq = {};
+	uint32_t sum = 0, top = 0;
+	for (int i = 0; i < 256; i++) {
+		if (count[i]) {
+			freq[i] = std::max<uint64_t>(1, count[i] * PROB_SCALE / n);
+			sum += freq[i];
+			if (count[i] > count[top]) {
+				top = i;
+			}
+		}
+	}
+
+	// Rounding errors are absorbed by the most frequent symbols
+	while (sum < PROB_SCALE) {
+		freq[top]++;
+		sum++;
+	}
+	while (sum > PROB_SCALE) {
+		int best = -1;
+		for (int i = 0; i < 256; i++) {
+			if (freq[i] > 1 && (best == -1 || freq[i] > freq[best])) {
+				best = i;
+			}
+		}
+		freq[best]--;
+		sum--;
+	}
+
+	return freq;
+}
+
+}
+
+void rans::encode(const uint8_t *in, size_t n, std::vector<uint8_t> &out) {
+	std::array<uint64_t, 256> count = {};
+	for (size_t i = 0; i < n; i++) {
+		count[in[i]]++;
+	}
+
+	auto store_raw = [&]() {
+		out.push_back(MODE_RAW);
+		out.insert(out.end(), in, in + n);
+	};
+
+	if (n == 0) {
+		store_raw();
+		return;
+	}
+
+	auto freq = normalize(count, n);
+	std::array<uint32_t, 256> cum;
+	for (uint32_t i = 0, c = 0; i < 256; i++) {
+		cum[i] = c;
+		c += freq[i];
+	}
+
+	// rANS emits words in reverse; encode into a scratch buffer from
+	// the end, with room for incompressible input
+	std::vector<uint8_t> buf(n + 4 * N_STATES + PADDING);
+	uint8_t *p = buf.data() + buf.size() - PADDING;
+	uint8_t *limit = buf.data() + 4 * N_STATES;
+	std::array<uint32_t, N_STATES> x;
+	x.fill(RANS_L);
+	for (size_t i = n; i-- > 0; ) {
+		uint32_t &xs = x[i % N_STATES];
+		uint32_t f = freq[in[i]];
+		if (xs >= (uint64_t(RANS_L >> PROB_BITS) << 16) * f) {
+			if (p - limit < 2) {
+				store_raw();
+				return;
+			}
+			*--p = xs >> 8;
+			*--p = xs;
+			xs >>= 16;
+		}
+		xs = ((xs / f) << PROB_BITS) + (xs % f) + cum[in[i]];
+	}
+	for (int j = N_STATES; j-- > 0; ) {
+		for (int k = 4; k-- > 0; ) {
+			*--p = x[j] >> (8 * k);
+		}
+	}
+
+	size_t len = buf.data() + buf.size() - p;
+	if (2 * 256 + len >= n) {
+		store_raw();
+		return;
+	}
+
+	out.push_back(MODE_RANS);
+	for (auto f : freq) {
+		out.push_back(f);
+		out.push_back(f >> 8);
+	}
+	out.insert(out.end(), p, p + len);
+}
+
+bool rans::decode(const uint8_t *in, size_t in_len, uint8_t *out, size_t n) {
+	if (in_len < 1) {
+		return false;
+	}
+	const uint8_t *end = in + in_len;
+
+	if (*in++ == MODE_RAW) {
+		if (size_t(end - in) != n) {
+			return false;
+		}
+		memcpy(out, in, n);
+		return true;
+	}
+
+	if (size_t(end - in) < 2 * 256 + 4 * N_STATES + PADDING) {
+		return false;
+	}
+
+	// Per-slot symbol and decoding parameters
+	struct slot_t {
+		uint16_t freq, bias;
+	};
+	std::vector<slot_t> slots(PROB_SCALE);
+	std::vector<uint8_t> slot_sym(PROB_SCALE);
+	uint32_t c = 0;
+	for (int i = 0; i < 256; i++) {
+		uint32_t f = in[0] | (in[1] << 8);
+		in += 2;
+		if (c + f > PROB_SCALE) {
+			return false;
+		}
+		for (uint32_t slot = c; slot < c + f; slot++) {
+			slots[slot] = { uint16_t(f), uint16_t(slot - c) };
+			slot_sym[slot] = i;
+		}
+		c += f;
+	}
+	if (c != PROB_SCALE) {
+		return false;
+	}
+
+	std::array<uint32_t, N_STATES> x;
+	for (auto &xs : x) {
+		xs = in[0] | (in[1] << 8) | (in[2] << 16) | (uint32_t(in[3]) << 24);
+		in += 4;
+	}
+	const uint8_t *stream_end = end - PADDING;
+
+	auto step = [&](uint32_t &xs, uint8_t *o) {
+		uint32_t slot = xs & (PROB_SCALE - 1);
+		*o = slot_sym[slot];
+		xs = slots[slot].freq * (xs >> PROB_BITS) + slots[slot].bias;
+
+		uint32_t w = in[0] | (in[1] << 8);
+		bool renorm = xs < RANS_L;
+		xs = renorm ? (xs << 16) | w : xs;
+		in += 2 * renorm;
+	};
+
+	// Each group reads at most PADDING bytes past the check
+	size_t i = 0;
+	for (; i + N_STATES <= n; i += N_STATES) {
+		if (in > stream_end) {
+			return false;
+		}
+		for (int j = 0; j < N_STATES; j++) {
+			step(x[j], out + i + j);
+		}
+	}
+	if (in > stream_end) {
+		return false;
+	}
+	for (int j = 0; i < n; i++, j++) {
+		step(x[j], out + i);
+	}
+
+	if (in != stream_end) {
+		return false;
+	}
+	for (auto xs : x) {
+		if (xs != RANS_L) {
+			return false;
+		}
+	}
+	return true;
+}
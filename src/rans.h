@@ -0,0 +1,42 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VCUBE_RANS_H
+#define VCUBE_RANS_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace vcube::rans {
+
+/* Order-0 byte-wise rANS entropy coder (after Fabian Giesen's ryg_rans),
+ * used to compress pruning table files.  Each call codes one independent
+ * block, so blocks can be compressed and decompressed in parallel.  Blocks
+ * that do not compress are stored raw.
+ */
+
+/* Appends the encoded block to "out" */
+void encode(const uint8_t *in, size_t n, std::vector<uint8_t> &out);
+
+/* Decodes a block of exactly "n" bytes; returns false on malformed input */
+bool decode(const uint8_t *in, size_t in_len, uint8_t *out, size_t n);
+
+}
+
+#endif
@@ -44,6 +44,9 @@ static constexpr cperm_t N_CPERM = 40320;
 using c4comb_t = uint32_t;
 static constexpr c4comb_t N_C4COMB = 70;
 
+using cudcycle_t = uint32_t;
+static constexpr cudcycle_t N_CUDCYCLE = 36;
+
 using e4comb_t = uint32_t;
 static constexpr e4comb_t N_E4COMB = 495;
 
@@ -0,0 +1,222 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+using namespace vcube;
+
+namespace {
+
+int io_uring_setup(unsigned entries, io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+template<typename T>
+T * ring_ptr(void *ring, unsigned off) {
+	return reinterpret_cast<T *>(static_cast<uint8_t *>(ring) + off);
+}
+
+}
+
+uring::uring(unsigned entries) :
+	fd(-1), entries(entries), queued(), inflight(),
+	sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sqes(MAP_FAILED), sq_ring_sz(), cq_ring_sz(), sqes_sz(),
+	sq_head(), sq_tail(), sq_mask(), cq_head(), cq_tail(), cq_mask(), cqes(), done(),
+	requests(), free_slots(), unsupported()
+{
+	io_uring_params p = {};
+	fd = io_uring_setup(entries, &p);
+	if (fd == -1) {
+		return;
+	}
+
+	sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	sqes_sz = p.sq_entries * sizeof(io_uring_sqe);
+	sq_ring = mmap(NULL, sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	cq_ring = mmap(NULL, cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	sqes = mmap(NULL, sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+		close_ring();
+		return;
+	}
+
+	this->entries = p.sq_entries;
+	requests.resize(p.sq_entries);
+	for (unsigned i = p.sq_entries; i > 0; i--) {
+		free_slots.push_back(i - 1);
+	}
+	sq_head = ring_ptr<unsigned>(sq_ring, p.sq_off.head);
+	sq_tail = ring_ptr<unsigned>(sq_ring, p.sq_off.tail);
+	sq_mask = ring_ptr<unsigned>(sq_ring, p.sq_off.ring_mask);
+	cq_head = ring_ptr<unsigned>(cq_ring, p.cq_off.head);
+	cq_tail = ring_ptr<unsigned>(cq_ring, p.cq_off.tail);
+	cq_mask = ring_ptr<unsigned>(cq_ring, p.cq_off.ring_mask);
+	cqes = ring_ptr<void>(cq_ring, p.cq_off.cqes);
+
+	// Submission queue entries map one to one to array slots
+	auto array = ring_ptr<unsigned>(sq_ring, p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; i++) {
+		array[i] = i;
+	}
+}
+
+uring::~uring() {
+	close_ring();
+}
+
+void uring::close_ring() {
+	if (sqes != MAP_FAILED) {
+		munmap(sqes, sqes_sz);
+	}
+	if (cq_ring != MAP_FAILED) {
+		munmap(cq_ring, cq_ring_sz);
+	}
+	if (sq_ring != MAP_FAILED) {
+		munmap(sq_ring, sq_ring_sz);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	sq_ring = cq_ring = sqes = MAP_FAILED;
+	fd = -1;
+}
+
+void uring::read(int file, void *buf, size_t len, off_t off, uint64_t tag) {
+	if (fd != -1 && queued + inflight == entries) {
+		wait(done.size() + 1);
+	}
+
+	request_t r = { file, buf, len, off, tag };
+	if (fd == -1 || free_slots.empty()) {
+		done.emplace_back(tag, sync_read(r));
+		return;
+	}
+
+	unsigned slot = free_slots.back();
+	free_slots.pop_back();
+	requests[slot] = r;
+
+	unsigned tail = *sq_tail;
+	auto &sqe = static_cast<io_uring_sqe *>(sqes)[tail & *sq_mask];
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READ;
+	sqe.fd = file;
+	sqe.addr = reinterpret_cast<uint64_t>(buf);
+	sqe.len = len;
+	sqe.off = off;
+	sqe.user_data = slot;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	queued++;
+}
+
+/* Submits the queued reads and waits until "n" completions are held */
+void uring::wait(unsigned n) {
+	while (done.size() < n && fd != -1) {
+		int r = enter(queued, n - done.size(), IORING_ENTER_GETEVENTS);
+		if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			fail_over();
+			break;
+		}
+		if (r > 0) {
+			queued -= r;
+			inflight += r;
+		}
+		reap();
+
+		// The rest of the reads go through pread
+		if (unsupported && !queued && !inflight) {
+			static std::atomic<bool> reported(false);
+			if (!reported.exchange(true)) {
+				fprintf(stderr, "io_uring does not support reads on this kernel; using pread\n");
+			}
+			close_ring();
+		}
+	}
+}
+
+/* After io_uring_enter fails: waits for the reads the kernel has taken,
+ * since it may still write to their buffers, redoes the others with
+ * pread, and closes the ring
+ */
+void uring::fail_over() {
+	static std::atomic<bool> reported(false);
+	if (!reported.exchange(true)) {
+		fprintf(stderr, "io_uring failed (%s); using pread\n", strerror(errno));
+	}
+
+	// The kernel advances the submission queue head as it takes reads
+	unsigned tail = *sq_tail;
+	unsigned unsubmitted = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	inflight += queued - unsubmitted;
+	queued = unsubmitted;
+
+	while (inflight) {
+		if (enter(0, inflight, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+			usleep(100);
+		}
+		reap();
+	}
+
+	for (unsigned t = tail - queued; t != tail; t++) {
+		unsigned slot = static_cast<io_uring_sqe *>(sqes)[t & *sq_mask].user_data;
+		done.emplace_back(requests[slot].tag, sync_read(requests[slot]));
+		free_slots.push_back(slot);
+	}
+	queued = 0;
+
+	close_ring();
+}
+
+void uring::reap() {
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		auto &cqe = static_cast<io_uring_cqe *>(cqes)[head & *cq_mask];
+		auto &r = requests[cqe.user_data];
+		int res = cqe.res;
+		if ((res == -EINVAL || res == -EOPNOTSUPP) && (res = sync_read(r)) >= 0) {
+			unsupported = true;
+		}
+		done.emplace_back(r.tag, res);
+		free_slots.push_back(cqe.user_data);
+		inflight--;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+int uring::enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return io_uring_enter(fd, to_submit, min_complete, flags);
+}
+
+int uring::sync_read(const request_t &r) {
+	ssize_t n = pread(r.file, r.buf, r.len, r.off);
+	return n == -1 ? -errno : int(n);
+}
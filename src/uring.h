@@ -0,0 +1,111 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VCUBE_URING_H
+#define VCUBE_URING_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace vcube {
+
+/* A minimal io_uring for batches of small reads, using the system calls
+ * directly.  Where io_uring is unavailable (old kernels, or disabled by
+ * a seccomp policy), reads are done synchronously with pread instead,
+ * with the same interface.  Kernels 5.1 to 5.5 have io_uring but fail
+ * IORING_OP_READ; those reads are redone with pread, and the ring is
+ * closed once it is idle.
+ */
+class uring {
+	int fd;
+	unsigned entries;
+	unsigned queued;   // reads prepared but not yet submitted
+	unsigned inflight; // reads submitted but not yet completed
+
+	void *sq_ring, *cq_ring, *sqes;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+	unsigned *sq_head, *sq_tail, *sq_mask;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	void *cqes;
+
+	// Completed reads not yet passed to the caller
+	std::vector<std::pair<uint64_t, int>> done;
+
+	// Reads in the ring, indexed by their user_data, so that they can
+	// be redone with pread
+	struct request_t {
+		int file;
+		void *buf;
+		size_t len;
+		off_t off;
+		uint64_t tag;
+	};
+	std::vector<request_t> requests;
+	std::vector<unsigned> free_slots;
+	bool unsupported; // the kernel does not support IORING_OP_READ
+
+    public:
+	explicit uring(unsigned entries = 256);
+	virtual ~uring();
+
+	uring(const uring &) = delete;
+	uring & operator = (const uring &) = delete;
+
+	/* True if reads are asynchronous */
+	bool async() const {
+		return fd != -1;
+	}
+
+	/* Queue a read of "len" bytes at "off" into "buf".  The tag is
+	 * returned with its completion.  If the ring is full, the queued
+	 * reads are submitted and this waits for one to complete.
+	 */
+	void read(int file, void *buf, size_t len, off_t off, uint64_t tag);
+
+	/* Submit the queued reads and wait until all reads have completed,
+	 * calling fn(tag, result) for each, where the result is the number
+	 * of bytes read or a negative errno.  If io_uring_enter fails, the
+	 * reads the kernel has are waited for, the rest are done with pread,
+	 * and the ring is closed.
+	 */
+	template<typename Fn>
+	void wait_all(Fn &&fn) {
+		wait(done.size() + inflight + queued);
+		for (auto &d : done) {
+			fn(d.first, d.second);
+		}
+		done.clear();
+	}
+
+    protected:
+	/* The io_uring_enter system call on the ring (tests make it fail) */
+	virtual int enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+
+    private:
+	void close_ring();
+	void wait(unsigned n);
+	void reap();
+	void fail_over();
+	static int sync_read(const request_t &r);
+};
+
+}
+
+#endif
@@ -22,6 +22,7 @@
 #include <array>
 #include <string>
 #include <vector>
+#include <x86intrin.h>
 #include "types.h"
 
 namespace vcube {
@@ -118,6 +119,17 @@ extern inline auto rank_4perm_oddeven(uint8_t bits) {
 	return tbl[bits];
 }
 
+/* Rank 0..5 of four 2-bit values (given as their low and high bit
+ * planes) that are a permutation of 0..3, up to adding a constant to
+ * all of them mod 4
+ */
+extern inline uint32_t rank_4cycle(uint32_t bits0, uint32_t bits1) {
+	uint32_t x = _pdep_u32(bits0, 0x1111) | _pdep_u32(bits1, 0x2222);
+	uint32_t rel = (x + 0x4444 - (x & 3) * 0x1111) & 0x3333;
+	uint32_t a = (rel >> 4) & 3, b = (rel >> 8) & 3, c = (rel >> 12) & 3;
+	return (a - 1) * 2 + (b > c);
+}
+
 struct moveseq_t : public std::vector<uint8_t> {
 	enum style_t { SINGMASTER, FIXED };
 
@@ -16,7 +16,9 @@
  * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <climits>
 #include <cstdio>
+#include <functional>
 #include <random>
 #include <chrono>
 #include <thread>
@@ -24,13 +26,24 @@
 #include <string>
 #include <utility>
 #include <algorithm>
-#include <deque>
+#include <map>
+#include <set>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <type_traits>
 #include <getopt.h>
 #include <libgen.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include "alloc.h"
+#include "numa.h"
 #include "nxprune.h"
 #include "nxprune_generator.h"
+#include "nxprune_checker.h"
+#include "nxdisk.h"
 #include "nxsolve.h"
+#include "nxvariant.h"
 
 using namespace vcube;
 
@@ -40,89 +53,132 @@ enum format_t {
 	FMT_SPEFFZ,
 };
 
+enum shm_t {
+	SHM_OFF,
+	SHM_SYSV,
+	SHM_POSIX,
+};
+
+enum numa_t {
+	NUMA_OFF,
+	NUMA_REPLICATE,
+	NUMA_INTERLEAVE,
+};
+
 /* Configuration */
 static struct {
 	std::string path;
 	uint32_t workers;
+	bool workers_set;   // --workers was given
 	uint32_t coord;
+	uint32_t base;      // 0 for the variant's chosen base
 	moveseq_t::style_t style;
 	std::array<int, 2> speffz_buffer;
 	format_t format;
 	bool no_input;
 	bool ordered;
-	bool shm;
+	shm_t shm;
 	bool inverse;
 	uint32_t depth;
+	std::string checkpoint_dir;
+	uint32_t checkpoint_interval;
+	uint32_t split;
+	bool unit;
+	moveseq_t unit_prefix;
+	bool merge;
+	bool hardest_first;
+	uint32_t probe;
+	uint32_t diverse;
+	bool mmap;
+	std::string mmap_dir;
+	bool direct_io;
+	bool compress;
+	nx::table_options::verify_t verify;
+	double check_table; // seconds to check table entries, 0 for none
+	numa_t numa;
+	bool corners;
+	bool cluster_rows;
+	double disk_table;  // GiB of cache, or negative to load the table
+	uint32_t derive_from;
+	uint32_t interim;   // variant to solve with while generating the table
+	bool exact;
 } cf;
 
+/* Options without a short equivalent */
+enum long_option_t {
+	OPT_CHECKPOINT_INTERVAL = 0x100,
+	OPT_SPLIT,
+	OPT_UNIT,
+	OPT_MERGE,
+	OPT_HARDEST_FIRST,
+	OPT_PROBE,
+	OPT_DIVERSE,
+	OPT_DIRECT_IO,
+	OPT_VERIFY_TABLE,
+	OPT_NO_VERIFY,
+	OPT_COMPRESS,
+	OPT_NUMA,
+	OPT_CORNERS,
+	OPT_CLUSTER_ROWS,
+	OPT_DISK_TABLE,
+	OPT_DERIVE_FROM,
+	OPT_EXACT,
+	OPT_CHECK_TABLE,
+	OPT_ALLOC,
+	OPT_MLOCK,
+	OPT_INTERIM,
+};
+
+/* A table being generated in the background (--interim).  Once it is
+ * ready, workers solve the cubes they take next with it instead of the
+ * interim table.
+ */
+struct upgrade_t {
+	std::atomic<bool> ready;
+	std::function<moveseq_t(const cube &c, const std::string &checkpoint)> solve;
+};
+
 static std::string base_path(const char *argv0);
+static cube parse_cube(const char *s);
+static int merge_units();
 
-template<nx::EPvariant EP, nx::EOvariant EO, int Base>
-static void solver(const std::string &table_filename, uint32_t shm_key);
+template<typename ECoord, int Base, typename Encoding>
+static void solver(const std::string &table_filename, uint32_t shm_key, upgrade_t *upgrade);
 static void usage(const char *argv0, int status = EXIT_FAILURE);
 
-struct solver_variant {
-	int id;
-	void (*func)(const std::string &, uint32_t shm_key);
-	std::string filename;
-	uint32_t shm_key;
-	size_t size;
-
-	bool operator < (const solver_variant &o) const {
-		return size < o.size;
-	}
-
-	void operator()() {
-		func(filename, shm_key);
-	}
-
-	template<nx::EPvariant EP, nx::EOvariant EO, int Base>
-	static solver_variant S(int id) {
-		char filename[64];
-		sprintf(filename, "tables/nxprune_%d_%02d_%02d.dat",
-				EP + 1, (EO + 1) * 4, Base);
-		uint32_t shm_key = 0x76630000 |
-			(Base << 8) |
-			((EP + 1) << 4) |
-			((EO + 1) * 4);
-		return {
-			id,
-			solver<EP, EO, Base>,
-			filename,
-			shm_key,
-			nx::prune<nx::ecoord<EP, EO>, Base>().size()
-		};
+struct solver_variant : nx::table_variant {
+	void (*func)(const std::string &, uint32_t shm_key, upgrade_t *upgrade);
+
+	void operator()(upgrade_t *upgrade = nullptr) {
+		func(filename, shm_key, upgrade);
 	}
 };
 
-/* Some variants are commented out, either because they do not yet have
- * a base value chosen (510 GiB and 4 TiB), or because they are too slow
- * and unnecessarily increase code size by instantiting templates that
- * will see little use.
- */
-static std::vector<solver_variant> solvers = {
-	//solver_variant::S<nx::EP1, nx::EO4,   7>(104),
-	//solver_variant::S<nx::EP1, nx::EO8,   8>(108),
-	solver_variant::S<nx::EP1, nx::EO12,  9>(112),
-
-	//solver_variant::S<nx::EP2, nx::EO4,   8>(204),
-	solver_variant::S<nx::EP2, nx::EO8,   9>(208),
-	solver_variant::S<nx::EP2, nx::EO12, 10>(212),
-
-	solver_variant::S<nx::EP3, nx::EO4,   8>(304),
-	solver_variant::S<nx::EP3, nx::EO8,  10>(308),
-	solver_variant::S<nx::EP3, nx::EO12, 10>(312), // base 11 reduces lookups by 0.2%
-
-	solver_variant::S<nx::EP4, nx::EO4,  10>(404),
-	//solver_variant::S<nx::EP4, nx::EO8,  ??>(408),
-	//solver_variant::S<nx::EP4, nx::EO12, ??>(412),
-};
+/* The variants of nx::for_each_variant */
+static std::vector<solver_variant> make_solvers() {
+	std::vector<solver_variant> list;
+	nx::for_each_variant([&](auto variant) {
+		using Prune = typename decltype(variant)::prune;
+		list.push_back({
+			nx::table_variant::make<decltype(variant)>(),
+			solver<typename Prune::ecoord, Prune::BASE, typename Prune::encoding>
+		});
+	});
+	return list;
+}
+
+static std::vector<solver_variant> solvers = make_solvers();
 static constexpr int DEFAULT_VARIANT = 308;
 
+/* Tables shared with --shm=posix */
+#define POSIX_SHM_DIR "/dev/shm/vcube"
+
 int main(int argc, char * const *argv) {
 	cf.path = base_path(argv[0]);
 	cf.workers = std::max(1U, std::thread::hardware_concurrency());
+	cf.workers_set = false;
 	cf.coord = DEFAULT_VARIANT;
+	cf.base = 0;
 	cf.style = moveseq_t::SINGMASTER;
 	cf.format = FMT_MOVES;
 	cf.speffz_buffer = { 'A', 'U' };
@@ -130,32 +186,165 @@ int main(int argc, char * const *argv) {
 	cf.ordered = false;
 	cf.inverse = false;
 	cf.depth = 20;
+	cf.checkpoint_interval = 60;
+	cf.split = 0;
+	cf.unit = false;
+	cf.merge = false;
+	cf.hardest_first = false;
+	cf.probe = 0;
+	cf.diverse = 0;
+	cf.mmap = false;
+	cf.direct_io = false;
+	cf.compress = false;
+	cf.verify = nx::table_options::VERIFY_AUTO;
+	cf.check_table = 0;
+	cf.numa = NUMA_OFF;
+	cf.corners = false;
+	cf.cluster_rows = false;
+	cf.disk_table = -1;
+	cf.derive_from = 0;
+	cf.interim = 0;
+	cf.exact = false;
 
 	for (;;) {
 		static struct option long_options[] = {
+			{ "alloc",    required_argument, 0, OPT_ALLOC },
+			{ "base",     required_argument, 0, 'b' },
+			{ "check-table", optional_argument, 0, OPT_CHECK_TABLE },
+			{ "checkpoint", required_argument, 0, 'C' },
+			{ "checkpoint-interval", required_argument, 0, OPT_CHECKPOINT_INTERVAL },
+			{ "cluster-rows", no_argument,   0, OPT_CLUSTER_ROWS },
+			{ "compress", no_argument,       0, OPT_COMPRESS },
 			{ "coord",    required_argument, 0, 'c' },
+			{ "corners",  no_argument,       0, OPT_CORNERS },
 			{ "depth",    required_argument, 0, 'd' },
+			{ "derive-from", required_argument, 0, OPT_DERIVE_FROM },
+			{ "direct-io", no_argument,      0, OPT_DIRECT_IO },
+			{ "disk-table", required_argument, 0, OPT_DISK_TABLE },
+			{ "diverse",  required_argument, 0, OPT_DIVERSE },
+			{ "exact",    no_argument,       0, OPT_EXACT },
 			{ "format",   required_argument, 0, 'f' },
+			{ "hardest-first", no_argument,  0, OPT_HARDEST_FIRST },
 			{ "help",     no_argument,       0, 'h' },
+			{ "interim",  required_argument, 0, OPT_INTERIM },
 			{ "inverse",  no_argument,       0, 'i' },
+			{ "merge",    no_argument,       0, OPT_MERGE },
+			{ "mlock",    no_argument,       0, OPT_MLOCK },
+			{ "mmap",     optional_argument, 0, 'M' },
 			{ "no-input", no_argument,       0, 'n' },
+			{ "no-verify", no_argument,      0, OPT_NO_VERIFY },
+			{ "numa",     optional_argument, 0, OPT_NUMA },
 			{ "ordered",  no_argument,       0, 'O' },
-			{ "shm",      no_argument,       0, 'S' },
+			{ "probe",    required_argument, 0, OPT_PROBE },
+			{ "shm",      optional_argument, 0, 'S' },
 			{ "speffz",   optional_argument, 0, 'z' },
+			{ "split",    required_argument, 0, OPT_SPLIT },
 			{ "style",    required_argument, 0, 's' },
+			{ "unit",     required_argument, 0, OPT_UNIT },
+			{ "verify-table", no_argument,   0, OPT_VERIFY_TABLE },
 			{ "workers",  required_argument, 0, 'w' },
 			{ NULL }
 		};
 
 		int option_index = 0;
 		int this_option_optind = optind ? optind : 1;
-		int c = getopt_long(argc, argv, "c:d:f:hinOSs:w:z::", long_options, &option_index);
+		int c = getopt_long(argc, argv, "b:C:c:d:f:hiM::nOS::s:w:z::", long_options, &option_index);
 		if (c == -1) {
 			break;
 		}
 
 		int len;
 		switch (c) {
+		    case 'C':
+			cf.checkpoint_dir = optarg;
+			break;
+		    case OPT_CHECKPOINT_INTERVAL:
+			cf.checkpoint_interval = strtoul(optarg, NULL, 10);
+			break;
+		    case OPT_SPLIT:
+			cf.split = strtoul(optarg, NULL, 10);
+			if (cf.split < 1 || cf.split > 5) {
+				fprintf(stderr, "Split length must be between 1 and 5\n");
+				usage(argv[0]);
+			}
+			break;
+		    case OPT_UNIT:
+			cf.unit = true;
+			cf.unit_prefix = moveseq_t::parse(optarg);
+			break;
+		    case OPT_MERGE:
+			cf.merge = true;
+			break;
+		    case OPT_HARDEST_FIRST:
+			cf.hardest_first = true;
+			break;
+		    case OPT_PROBE:
+			cf.probe = strtoul(optarg, NULL, 10);
+			break;
+		    case OPT_DIRECT_IO:
+			cf.direct_io = true;
+			break;
+		    case OPT_VERIFY_TABLE:
+			cf.verify = nx::table_options::VERIFY_ALWAYS;
+			break;
+		    case OPT_NO_VERIFY:
+			cf.verify = nx::table_options::VERIFY_NEVER;
+			break;
+		    case OPT_CHECK_TABLE:
+			cf.check_table = optarg ? std::max(0.0, strtod(optarg, NULL)) : 2;
+			break;
+		    case OPT_COMPRESS:
+			cf.compress = true;
+			break;
+		    case OPT_CORNERS:
+			cf.corners = true;
+			break;
+		    case OPT_CLUSTER_ROWS:
+			cf.cluster_rows = true;
+			break;
+		    case OPT_DISK_TABLE:
+			cf.disk_table = std::max(0.0, strtod(optarg, NULL));
+			break;
+		    case OPT_DERIVE_FROM:
+			cf.derive_from = strtoul(optarg, NULL, 10);
+			break;
+		    case OPT_INTERIM:
+			cf.interim = strtoul(optarg, NULL, 10);
+			break;
+		    case OPT_EXACT:
+			cf.exact = true;
+			break;
+		    case OPT_ALLOC:
+			len = strlen(optarg);
+			if (!strncmp(optarg, "hugetlb", len)) {
+				alloc::policy.backend = alloc::HUGETLB;
+			} else if (!strncmp(optarg, "transparent", len)) {
+				alloc::policy.backend = alloc::TRANSPARENT;
+			} else {
+				fprintf(stderr, "Unsupported allocation type '%s'\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		    case OPT_MLOCK:
+			alloc::policy.lock = true;
+			break;
+		    case OPT_NUMA:
+			len = optarg ? strlen(optarg) : 0;
+			if (!optarg || !strncmp(optarg, "replicate", len)) {
+				cf.numa = NUMA_REPLICATE;
+			} else if (!strncmp(optarg, "interleave", len)) {
+				cf.numa = NUMA_INTERLEAVE;
+			} else {
+				fprintf(stderr, "Unsupported NUMA mode '%s'\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		    case OPT_DIVERSE:
+			cf.diverse = std::min(18UL, strtoul(optarg, NULL, 10));
+			break;
+		    case 'b':
+			cf.base = strtoul(optarg, NULL, 10);
+			break;
 		    case 'c':
 			cf.coord = strtoul(optarg, NULL, 10);
 			break;
@@ -186,6 +375,12 @@ int main(int argc, char * const *argv) {
 				}
 			}
 			break;
+		    case 'M':
+			cf.mmap = true;
+			if (optarg) {
+				cf.mmap_dir = optarg;
+			}
+			break;
 		    case 'n':
 			cf.no_input = true;
 			break;
@@ -193,7 +388,15 @@ int main(int argc, char * const *argv) {
 			cf.ordered = true;
 			break;
 		    case 'S':
-			cf.shm = true;
+			len = optarg ? strlen(optarg) : 0;
+			if (!optarg || !strncmp(optarg, "sysv", len)) {
+				cf.shm = SHM_SYSV;
+			} else if (!strncmp(optarg, "posix", len)) {
+				cf.shm = SHM_POSIX;
+			} else {
+				fprintf(stderr, "Unsupported shared memory type '%s'\n", optarg);
+				usage(argv[0]);
+			}
 			break;
 		    case 's':
 			len = strlen(optarg);
@@ -211,6 +414,7 @@ int main(int argc, char * const *argv) {
 			break;
 		    case 'w':
 			cf.workers = strtoul(optarg, NULL, 10);
+			cf.workers_set = true;
 			break;
 		    default:
 			usage(argv[0], EXIT_SUCCESS);
@@ -219,14 +423,17 @@ int main(int argc, char * const *argv) {
 
 	setbuf(stdout, NULL);
 
-	for (auto &S : solvers) {
-		if (S.id == cf.coord) {
-			S();
-			return 0;
-		}
+	if (cf.merge) {
+		// Merging work unit results does not require the pruning table
+		return merge_units();
 	}
 
-	fprintf(stderr, "Unsupported edge coordinate '%d'\n", cf.coord);
+	if (auto S = nx::find_variant(solvers, cf.coord, cf.exact, cf.base)) {
+		(*S)();
+		return 0;
+	}
+
+	nx::report_missing_variant(solvers, cf.coord, cf.exact, cf.base);
 	exit(EXIT_FAILURE);
 }
 
@@ -255,23 +462,78 @@ void usage(const char *argv0, int status) {
 		"Options:\n"
 		"  -h, --help\n"
 		"  -c, --coord=COORD           pruning coordinate variant\n"
+		"  -b, --base=BASE             pruning table base depth, instead of the one\n"
+		"                              chosen for the variant (see below)\n"
 		"  -d, --depth=DEPTH           maximum depth to search\n"
+		"      --exact                 use a table of exact distances (4 bits per\n"
+		"                              entry) instead of 2-bit values\n"
+		"      --corners               also prune with an exact corner table (44 MB)\n"
 		"  -f, --format=FORMAT         input format\n"
 		"  -z, --speffz=[C[E]]         speffz buffers (implies -f speffz)\n"
 		"  -n, --no-input              load/generate tables and exit\n"
 		"  -O, --ordered               output in the same order as input\n"
-		"  -S, --shm                   load table into shared memory\n"
+		"  -S, --shm[=TYPE]            load table into shared memory: sysv (default)\n"
+		"                              or posix (" POSIX_SHM_DIR ")\n"
+		"  -M, --mmap[=DIR]            map the table file instead of reading it;\n"
+		"                              if DIR is given (e.g. a hugetlbfs mount),\n"
+		"                              the table is copied there on first use\n"
+		"      --direct-io             read the table bypassing the page cache\n"
+		"      --disk-table=CACHE      read the table from its file during the search,\n"
+		"                              with CACHE GiB of it held in memory\n"
+		"      --verify-table          verify table checksums, even if verified before\n"
+		"      --no-verify             never verify table checksums\n"
+		"      --check-table[=SECONDS] check a sample of table entries against\n"
+		"                              brute-force distances for SECONDS\n"
+		"                              (default: 2) before solving\n"
+		"      --compress              store the table file compressed\n"
+		"      --cluster-rows          store the table with neighboring corner\n"
+		"                              classes close together in memory\n"
+		"      --derive-from=COORD     build a missing table from the larger table\n"
+		"                              of variant COORD instead of generating it\n"
+		"      --interim=COORD         if the table must be generated, solve with\n"
+		"                              the table of variant COORD meanwhile, and\n"
+		"                              switch once it is ready; it is generated\n"
+		"                              with the cores not used by the workers\n"
+		"                              (half of them unless --workers is given)\n"
+		"      --numa[=MODE]           NUMA table placement: replicate (default)\n"
+		"                              a copy per node, or interleave one copy\n"
+		"      --alloc=TYPE            table memory: hugetlb (default) reserved\n"
+		"                              huge pages, falling back to transparent\n"
+		"                              huge pages, or transparent only\n"
+		"      --mlock                 lock table memory so it is never swapped out\n"
 		"  -s, --style=STYLE           output style\n"
 		"  -i, --inverse               output scrambles instead of solutions\n"
 		"  -w, --workers=NUM           worker count (default: cpu core count)\n"
+		"      --hardest-first         read all input first, then solve the cubes\n"
+		"                              predicted to be hardest first\n"
+		"      --probe=EXTRA           with --hardest-first, rank cubes by the cost\n"
+		"                              of one search EXTRA moves past the lower\n"
+		"                              bound (default: 0, lower bound only)\n"
+		"      --diverse=NUM           output up to NUM optimal solutions per cube,\n"
+		"                              each with a different first move\n"
+		"  -C, --checkpoint=DIR        save solver progress to DIR, resume on restart\n"
+		"      --checkpoint-interval=SECONDS\n"
+		"                              time between checkpoints (default: 60)\n"
+		"\n"
+		"Splitting a single cube into independent work units:\n"
+		"      --split=LEN             read one cube, output the move prefixes\n"
+		"                              of length LEN (1-5), one per line\n"
+		"      --unit=PREFIX           read one cube, solve only the subtree\n"
+		"                              below PREFIX, up to --depth moves\n"
+		"      --merge                 read --unit output lines, output the\n"
+		"                              optimal solution if all units are present\n"
 		"\n"
 		"Pruning coordinate variants (COORD):\n"
 		, stdout);
 	std::sort(solvers.begin(), solvers.end());
+	std::set<std::pair<int, bool>> listed;
 	for (auto &S : solvers) {
-		fprintf(stdout, "  %3d (%s)%s\n",
-				S.id, format_table_size(S.size).c_str(),
-				S.id == DEFAULT_VARIANT ? " [default]" : "");
+		if (listed.insert({ S.id, S.exact }).second) {
+			fprintf(stdout, "  %3d%s (%s, %s)%s\n",
+					S.id, S.exact ? " --exact" : "", format_table_size(S.size).c_str(),
+					nx::variant_bases(solvers, S.id, S.exact).c_str(),
+					S.id == DEFAULT_VARIANT && !S.exact ? " [default]" : "");
+		}
 	}
 	fputs(	 /**********************************************************************/
 		"\n"
@@ -313,6 +575,57 @@ std::string base_path(const char *argv0) {
 	return path;
 }
 
+cube parse_cube(const char *s) {
+	cube c;
+	switch (cf.format) {
+	    case FMT_MOVES:
+		c = cube::from_moves(s);
+		break;
+	    case FMT_REID:
+		c = cube::from_reid(s);
+		break;
+	    case FMT_SPEFFZ:
+		c = cube::from_speffz(s, cf.speffz_buffer[0], cf.speffz_buffer[1]);
+		break;
+	}
+	if (cf.inverse) c = ~c;
+	return c;
+}
+
+/* Reads the lines output by --unit and combines them into a single
+ * result.  The result is only reported as optimal when every prefix of
+ * the split is accounted for, and lines of a different cube, split
+ * length or depth are rejected.
+ */
+int merge_units() {
+	char buf[1024];
+	nx::solver_base::merge_t merge;
+	while (fgets(buf, sizeof(buf), stdin)) {
+		if (buf[strspn(buf, " \t\r\n")] == '\0') {
+			continue;
+		}
+		nx::solver_base::unit_t unit;
+		const char *error = unit.parse(buf) ? merge.add(unit) : "not a --unit result";
+		if (error) {
+			fprintf(stderr, "Rejected %s: %s", error, buf);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!merge.complete()) {
+		fprintf(stderr, "Incomplete: %lu of %lu units\n", merge.seen.size(), merge.n_units());
+		return EXIT_FAILURE;
+	}
+
+	if (!merge.found) {
+		fprintf(stderr, "No solution up to depth %u\n", merge.depth);
+		return EXIT_FAILURE;
+	}
+
+	printf("%lu %s\n", merge.best.size(), merge.best.to_string(cf.style).c_str());
+	return EXIT_SUCCESS;
+}
+
 class cpu_clock {
     public:
 	using duration = std::chrono::microseconds;
@@ -326,72 +639,265 @@ class cpu_clock {
 	}
 };
 
-template<nx::EPvariant EP, nx::EOvariant EO, int Base>
-void solver(const std::string &table_filename, uint32_t shm_key) {
-	using ECoord = nx::ecoord<EP, EO>;
-	using Prune = nx::prune<ECoord, Base>;
+/* Finds up to cf.diverse optimal solutions with distinct first moves.
+ * Each depth is searched with the subtrees below the 18 first moves
+ * divided among the workers; the first depth with any solution is optimal.
+ */
+template<typename Prune>
+static std::vector<moveseq_t> solve_diverse(Prune &P, const cube6 &c6) {
+	std::vector<moveseq_t> solutions;
+	if (c6 == cube()) {
+		solutions.emplace_back();
+		return solutions;
+	}
 
-	Prune P;
+	for (int depth = std::max(1, int(P.initial_depth(c6))); depth <= cf.depth; depth++) {
+		std::array<moveseq_t, N_MOVES> found;
+		std::atomic<int> next_move(0), n_found(0);
+		std::vector<std::thread> workers;
+		for (int i = 0; i < std::min<int>(cf.workers, N_MOVES); i++) {
+			workers.push_back(std::thread([&]() {
+						nx::solver S(P);
+						for (int m; (m = next_move++) < N_MOVES && n_found < cf.diverse; ) {
+							if (S.search_prefix(c6, moveseq_t{ uint8_t(m) }, depth, found[m])) {
+								n_found++;
+							}
+						}
+						}));
+		}
+		for (auto &t : workers) {
+			t.join();
+		}
 
-	std::string table_fullpath = cf.path + "/" + table_filename;
-	if (!P.loadShared(shm_key)) {
-		bool ok;
-		if (cf.shm) {
-			ok = P.loadShared(shm_key, table_fullpath);
-		} else {
-			ok = P.load(table_fullpath);
+		for (auto &moves : found) {
+			if (!moves.empty() && solutions.size() < cf.diverse) {
+				solutions.push_back(moves.canonical());
+			}
 		}
-		if (!ok) {
-			nx::prune_generator gen(P, cf.workers);
-			gen.generate();
-			P.save(table_fullpath);
+		if (!solutions.empty()) {
+			break;
 		}
 	}
 
-	if (cf.no_input) {
-		// generate tables only
-		return;
+	return solutions;
+}
+
+/* Reads all of standard input, and orders it so the cubes predicted to
+ * be hardest are solved first.  The prediction is the pruning table lower
+ * bound, with ties broken by the cost of an optional probe search.
+ */
+template<typename Prune>
+static void schedule_hardest_first(Prune &P, std::vector<std::string> &input, std::vector<uint64_t> &schedule) {
+	char buf[1024];
+	while (fgets(buf, sizeof(buf), stdin)) {
+		input.push_back(buf);
+	}
+
+	// Lower bounds are looked up a chunk of cubes at a time
+	constexpr uint64_t CHUNK = 1024;
+	std::vector<uint64_t> difficulty(input.size());
+	std::vector<cube6> c6(input.size());
+	std::vector<uint8_t> depth(input.size());
+	std::atomic<uint64_t> next_id(0);
+	std::vector<std::thread> workers;
+	for (int i = 0; i < cf.workers; i++) {
+		workers.push_back(std::thread([&]() {
+					nx::solver S(P);
+					for (uint64_t first; (first = next_id.fetch_add(CHUNK)) < input.size(); ) {
+						uint64_t last = std::min<uint64_t>(first + CHUNK, input.size());
+						for (uint64_t id = first; id < last; id++) {
+							c6[id] = parse_cube(input[id].c_str());
+						}
+						P.lookup_many(&c6[first], last - first, &depth[first]);
+						for (uint64_t id = first; id < last; id++) {
+							uint64_t cost = cf.probe ? S.probe(c6[id], cf.probe) : 0;
+							difficulty[id] = (uint64_t(depth[id]) << 48) | std::min<uint64_t>(cost, (1ULL << 48) - 1);
+						}
+					}
+					}));
+	}
+	for (auto &t : workers) {
+		t.join();
+	}
+
+	schedule.resize(input.size());
+	for (uint64_t id = 0; id < input.size(); id++) {
+		schedule[id] = id;
+	}
+	std::stable_sort(schedule.begin(), schedule.end(), [&difficulty](uint64_t a, uint64_t b) {
+			return difficulty[a] > difficulty[b];
+			});
+}
+
+/* Random lookups into a table in 4 KiB pages thrash the TLB, so make
+ * it visible when huge pages were not obtained
+ */
+static void report_pages(const char *what, const uint8_t *mem, size_t n) {
+	auto pg = alloc::pages(mem, n);
+	const char *unit = "KiB";
+	size_t size = pg.page_size >> 10;
+	if (size >= 1024) {
+		size >>= 10;
+		unit = "MiB";
+	}
+	if (size >= 1024) {
+		size >>= 10;
+		unit = "GiB";
+	}
+	fprintf(stderr, "%s: %lu %s pages, %.1f%% in huge pages\n", what, size, unit, 100.0 * pg.huge_bytes / n);
+}
+
+/* Memory from alloc, by page size */
+static void report_alloc() {
+	auto st = alloc::stats();
+	fprintf(stderr, "Allocated: %lu MiB in 1 GiB pages, %lu MiB in 2 MiB pages, %lu MiB in standard or transparent huge pages",
+			st.bytes_1g >> 20, st.bytes_2m >> 20, st.bytes_4k >> 20);
+	if (alloc::policy.lock) {
+		fprintf(stderr, ", %lu MiB locked", st.locked >> 20);
+	}
+	fprintf(stderr, "\n");
+}
+
+/* The exact corner table for --corners, generated on first use */
+static const nx::corner_table * corner_table() {
+	static nx::corner_table corners;
+	static std::once_flag generated;
+	std::call_once(generated, []() {
+			corners.generate(cf.workers);
+			});
+	return &corners;
+}
+
+/* Solves the input cubes, worker i using table replicas[i % n], or the
+ * upgraded table once it is ready
+ */
+template<typename Prune>
+static void solve_input(Prune &P, const std::vector<Prune *> &replicas, const std::vector<int> &nodes, upgrade_t *upgrade = nullptr) {
+	if (cf.corners) {
+		for (auto R : replicas) {
+			R->setCornerTable(corner_table());
+		}
 	}
 
 	nx::solver_base::init();
 
+	if (cf.split || cf.unit) {
+		char buf[1024];
+		if (!fgets(buf, sizeof(buf), stdin)) {
+			return;
+		}
+		cube c = parse_cube(buf);
+		cube6 c6 = c;
+		nx::solver S(P);
+
+		if (cf.split) {
+			// Solutions shorter than the prefix length are not covered
+			// by any unit, so look for them here
+			auto moves = S.solve(c6, cf.split - 1);
+			if (!moves.empty() || c6 == cube()) {
+				moves = moves.canonical();
+				printf("%lu %s\n", moves.size(), moves.to_string(cf.style).c_str());
+				return;
+			}
+
+			fprintf(stderr, "Lower bound: %d\n", P.initial_depth(c6));
+			for (auto &prefix : nx::solver_base::prefixes(cf.split)) {
+				puts(prefix.to_string(moveseq_t::FIXED).c_str());
+			}
+		} else {
+			nx::solver_base::unit_t unit;
+			unit.cube_hash = unit.hash(c);
+			unit.prefix = cf.unit_prefix;
+			unit.depth = cf.depth;
+			unit.found = S.solve_prefix(c6, cf.unit_prefix, unit.solution, cf.depth);
+			unit.solution = unit.solution.canonical();
+			puts(unit.to_string(cf.style).c_str());
+		}
+		return;
+	}
+
+	if (cf.diverse) {
+		// Cubes are solved one at a time, using all workers for each
+		char buf[1024];
+		for (uint64_t solution_id = 0; fgets(buf, sizeof(buf), stdin); solution_id++) {
+			auto t0 = std::chrono::steady_clock::now();
+			auto solutions = solve_diverse(P, parse_cube(buf));
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+			for (auto &moves : solutions) {
+				printf("%lu %.9f %lu %s\n",
+						solution_id,
+						elapsed.count(),
+						moves.size(),
+						moves.to_string(cf.style).c_str());
+			}
+		}
+		return;
+	}
+
+	if (!cf.checkpoint_dir.empty()) {
+		(void) mkdir(cf.checkpoint_dir.c_str(), 0777);
+	}
+
 	auto t0 = std::chrono::steady_clock::now();
 	auto cpu_t0 = cpu_clock::now();
 
-	std::deque<std::string> solutions;
-	uint64_t next_id = 0;
+	// Completed solutions waiting to be output in input order
+	std::map<uint64_t, std::string> solutions;
+	uint64_t next_id = 0, next_output = 0;
+
+	// With --hardest-first, all input is read and ranked up front, and
+	// the workers take cubes in schedule order instead of input order
+	std::vector<std::string> input;
+	std::vector<uint64_t> schedule;
+	if (cf.hardest_first) {
+		schedule_hardest_first(P, input, schedule);
+	}
 
 	std::mutex mtx, out_mtx;
 	std::vector<std::thread> workers;
 	for (int i = 0; i < cf.workers; i++) {
-		workers.push_back(std::thread([&mtx, &out_mtx, &P, &next_id, &solutions]() {
+		workers.push_back(std::thread([&, i]() {
 					char buf[1024];
-					decltype(solutions)::iterator solutionp;
-					nx::solver S(P);
+					size_t node_idx = i % replicas.size();
+					if (cf.numa == NUMA_REPLICATE) {
+						numa::pin(nodes[node_idx]);
+					}
+					nx::solver S(*replicas[node_idx]);
 					mtx.lock();
-					while (!feof(stdin) && fgets(buf, sizeof(buf), stdin)) {
-						uint64_t solution_id = next_id++;
-						if (cf.ordered) {
-							solutionp = solutions.insert(solutions.end(), "");
+					for (;;) {
+						uint64_t solution_id;
+						if (cf.hardest_first) {
+							if (next_id == schedule.size()) {
+								break;
+							}
+							solution_id = schedule[next_id++];
+							snprintf(buf, sizeof(buf), "%s", input[solution_id].c_str());
+						} else if (!feof(stdin) && fgets(buf, sizeof(buf), stdin)) {
+							solution_id = next_id++;
+						} else {
+							break;
 						}
 						mtx.unlock();
 
-						cube c;
-						switch (cf.format) {
-						    case FMT_MOVES:
-							c = cube::from_moves(buf);
-							break;
-						    case FMT_REID:
-							c = cube::from_reid(buf);
-							break;
-						    case FMT_SPEFFZ:
-							c = cube::from_speffz(buf, cf.speffz_buffer[0], cf.speffz_buffer[1]);
-							break;
+						cube c = parse_cube(buf);
+
+						// Checkpoints are keyed by input sequence number; the cube
+						// itself is verified before resuming
+						std::string checkpoint;
+						if (!cf.checkpoint_dir.empty()) {
+							checkpoint = cf.checkpoint_dir + "/" + std::to_string(solution_id) + ".ckpt";
 						}
-						if (cf.inverse) c = ~c;
 
 						auto t0 = std::chrono::steady_clock::now();
-						auto moves = S.solve(c, cf.depth);
+						moveseq_t moves;
+						if (upgrade && upgrade->ready) {
+							moves = upgrade->solve(c, checkpoint);
+						} else {
+							if (!checkpoint.empty()) {
+								S.set_checkpoint(checkpoint, std::chrono::seconds(cf.checkpoint_interval));
+							}
+							moves = S.solve(c, cf.depth);
+						}
 						std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
 
 						moves = moves.canonical();
@@ -405,10 +911,11 @@ void solver(const std::string &table_filename, uint32_t shm_key) {
 
 						out_mtx.lock();
 						if (cf.ordered) {
-							*solutionp = buf;
-							while (!solutions.empty() && !solutions.front().empty()) {
-								puts(solutions.front().c_str());
-								solutions.pop_front();
+							solutions.emplace(solution_id, buf);
+							while (!solutions.empty() && solutions.begin()->first == next_output) {
+								puts(solutions.begin()->second.c_str());
+								solutions.erase(solutions.begin());
+								next_output++;
 							}
 						} else {
 							puts(buf);
@@ -432,3 +939,230 @@ void solver(const std::string &table_filename, uint32_t shm_key) {
 			cpu_elapsed.count(),
 			cpu_elapsed.count() / cf.workers);
 }
+
+/* Builds the table P from the table of variant cf.derive_from, using the
+ * 2-bit table with the chosen base of nx::for_each_variant, if its
+ * coordinate determines P's
+ */
+template<typename Prune>
+static bool derive_from(Prune &P, const nx::table_options &opt) {
+	bool ok = false, found = false;
+	nx::for_each_variant([&](auto variant) {
+		using Variant = decltype(variant);
+		using Source = typename Variant::prune;
+		if constexpr (Variant::PREFERRED && !Variant::EXACT && nx::prune_deriver<Prune, Source>::VALID) {
+			if (!found && Source::ecoord::ID == cf.derive_from) {
+				found = true;
+				auto S = nx::table_variant::make<Variant>();
+				std::string source_fullpath = cf.path + "/" + S.filename;
+				fprintf(stderr, "Deriving table from %s\n", source_fullpath.c_str());
+				nx::prune_deriver<Prune, Source> deriver(P, cf.workers);
+				ok = deriver.derive(source_fullpath, opt);
+				if (!ok) {
+					fprintf(stderr, "Could not read %s\n", source_fullpath.c_str());
+				}
+			}
+		}
+	});
+	return ok;
+}
+
+/* Generates the table P in the background, on the cores not used by the
+ * workers, while solving with the table of variant cf.interim.  Cubes
+ * are solved with P once it is ready.  Unless --workers was given, the
+ * cores are split evenly between the two.
+ */
+template<typename Prune>
+static void solve_interim(Prune &P, const nx::table_options &opt, const std::string &table_fullpath) {
+	auto interim = std::find_if(solvers.begin(), solvers.end(), [](const solver_variant &S) {
+			return S.id == cf.interim && !S.exact && S.preferred;
+			});
+	if (interim == solvers.end()) {
+		fprintf(stderr, "Unsupported interim edge coordinate '%d'\n", cf.interim);
+		exit(EXIT_FAILURE);
+	}
+
+	upgrade_t upgrade;
+	upgrade.ready = false;
+	int n_cores = std::max(1U, std::thread::hardware_concurrency());
+	if (!cf.workers_set) {
+		cf.workers = std::max(1, n_cores / 2);
+	}
+	int n_threads = std::max(1, n_cores - int(cf.workers));
+	fprintf(stderr, "Generating %s in the background with %d threads\n", table_fullpath.c_str(), n_threads);
+	std::thread generator([&]() {
+			nx::prune_generator gen(P, n_threads);
+			gen.generate();
+			P.reorder(opt.rows);
+			P.save(table_fullpath, opt);
+			report_pages("Table memory", P.data(), P.size());
+			if (cf.corners) {
+				P.setCornerTable(corner_table());
+			}
+
+			upgrade.solve = [&P](const cube &c, const std::string &checkpoint) {
+				nx::solver S(P);
+				if (!checkpoint.empty()) {
+					S.set_checkpoint(checkpoint, std::chrono::seconds(cf.checkpoint_interval));
+				}
+				return S.solve(c, cf.depth);
+			};
+			upgrade.ready = true;
+			fprintf(stderr, "Switching to %s\n", table_fullpath.c_str());
+			});
+
+	(*interim)(&upgrade);
+
+	// The input may run out first; the table is still finished and saved
+	generator.join();
+}
+
+template<typename ECoord, int Base, typename Encoding>
+void solver(const std::string &table_filename, uint32_t shm_key, upgrade_t *upgrade) {
+	using Prune = nx::prune<ECoord, Base, Encoding>;
+
+	Prune P;
+
+	nx::table_options opt;
+	opt.n_threads = cf.workers;
+	opt.direct = cf.direct_io;
+	opt.compress = cf.compress;
+	opt.verify = cf.verify;
+	if (cf.cluster_rows) {
+		// SysV segments have no header, so the order is part of the key
+		opt.rows = nx::table_options::ROWS_CLUSTERED;
+		shm_key |= 0x8000;
+	}
+
+	auto nodes = numa::nodes();
+	if (cf.numa == NUMA_REPLICATE) {
+		opt.node = nodes[0];
+	} else if (cf.numa == NUMA_INTERLEAVE) {
+		opt.node = alloc::INTERLEAVE;
+	}
+
+	std::string table_fullpath = cf.path + "/" + table_filename;
+	std::string name = table_filename.substr(table_filename.rfind('/') + 1);
+	std::string posix_shm = std::string(POSIX_SHM_DIR) + "/" + name;
+
+	if (cf.disk_table >= 0) {
+		// The table must already exist; generating it needs it in memory
+		nx::disk_prune<ECoord, Base, Encoding> D;
+		if (!D.open(table_fullpath, opt, cf.disk_table * (1 << 30))) {
+			fprintf(stderr, "Could not open %s\n", table_fullpath.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (cf.no_input) {
+			return;
+		}
+		solve_input(D, { &D }, nodes, upgrade);
+		fprintf(stderr, "Disk table: %.1f%% of lookups read from the file (%lu reads, %lu errors)\n",
+				D.stripes() ? 100.0 * D.reads() / D.stripes() : 0.0, D.reads(), D.errors());
+		return;
+	}
+
+	// Without --shm, a table already in either kind of shared memory
+	// is used
+	if (cf.shm != SHM_POSIX && P.loadShared(shm_key, "", opt)) {
+		if (cf.verify == nx::table_options::VERIFY_ALWAYS && !P.verify(table_fullpath, opt)) {
+			fprintf(stderr, "Shared memory table 0x%08x does not match %s\n", shm_key, table_fullpath.c_str());
+			exit(EXIT_FAILURE);
+		}
+	} else if (cf.shm != SHM_SYSV && P.loadMapped(posix_shm, opt)) {
+		// Attached to a table in POSIX shared memory
+	} else {
+		bool ok;
+		if (cf.shm == SHM_SYSV) {
+			ok = P.loadShared(shm_key, table_fullpath, opt);
+		} else if (cf.shm == SHM_POSIX) {
+			(void) mkdir(POSIX_SHM_DIR, 0777);
+			ok = P.loadMapped(posix_shm, opt, table_fullpath);
+		} else if (cf.mmap && !cf.mmap_dir.empty()) {
+			ok = P.loadMapped(cf.mmap_dir + "/" + name, opt, table_fullpath);
+		} else if (cf.mmap) {
+			// Compressed tables cannot be mapped, so read them instead
+			ok = P.loadMapped(table_fullpath, opt) || P.load(table_fullpath, opt);
+		} else {
+			ok = P.load(table_fullpath, opt);
+			if (ok && P.legacy()) {
+				// Rewrite tables from older versions with a header
+				fprintf(stderr, "Adding header to %s\n", table_fullpath.c_str());
+				P.save(table_fullpath, opt);
+			} else if (ok && cf.cluster_rows && P.rowOrder() != opt.rows) {
+				fprintf(stderr, "Reordering rows of %s\n", table_fullpath.c_str());
+				P.reorder(opt.rows);
+				opt.compress |= P.compressed();
+				P.save(table_fullpath, opt);
+			} else if (ok && cf.compress && !P.compressed()) {
+				fprintf(stderr, "Compressing %s\n", table_fullpath.c_str());
+				P.save(table_fullpath, opt);
+			}
+		}
+		if (ok && P.derived()) {
+			fprintf(stderr, "Note: %s was derived from a larger table; delete it to generate the full table\n",
+					table_fullpath.c_str());
+		}
+		if (!ok && cf.derive_from) {
+			ok = derive_from(P, opt);
+			if (ok) {
+				P.reorder(opt.rows);
+				P.save(table_fullpath, opt);
+			} else {
+				fprintf(stderr, "Cannot derive table %u from %u, generating it\n", ECoord::ID, cf.derive_from);
+			}
+		}
+		if (!ok && cf.interim && cf.interim != ECoord::ID && !cf.no_input && !cf.split && !cf.unit && !cf.diverse) {
+			solve_interim(P, opt, table_fullpath);
+			return;
+		}
+		if (!ok) {
+			nx::prune_generator gen(P, cf.workers);
+			gen.generate();
+			P.reorder(opt.rows);
+			P.save(table_fullpath, opt);
+		}
+	}
+
+	report_pages("Table memory", P.data(), P.size());
+
+	if (cf.check_table > 0) {
+		nx::prune_checker checker(P, cf.workers);
+		auto res = checker.check(std::chrono::duration<double>(cf.check_table));
+		fprintf(stderr, "Table check: %lu entries, %lu by search, %lu errors\n",
+				res.samples, res.searched, res.errors);
+		if (res.errors) {
+			fprintf(stderr, "The table is damaged; delete %s (or the shared memory copy) to rebuild it\n",
+					table_fullpath.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (cf.no_input) {
+		// generate tables only
+		report_alloc();
+		return;
+	}
+
+	// One table per NUMA node; workers are pinned to a node and use its
+	// local copy.  Nodes without a copy share the first one.
+	std::vector<Prune *> replicas = { &P };
+	std::vector<std::unique_ptr<Prune>> replica_storage;
+	if (cf.numa == NUMA_REPLICATE) {
+		for (size_t i = 1; i < nodes.size(); i++) {
+			auto R = std::make_unique<Prune>();
+			opt.node = nodes[i];
+			if (R->replicate(P, opt)) {
+				auto what = "Table memory on node " + std::to_string(nodes[i]);
+				report_pages(what.c_str(), R->data(), R->size());
+				replicas.push_back(R.get());
+				replica_storage.push_back(std::move(R));
+			} else {
+				fprintf(stderr, "Not enough memory for a table on NUMA node %d (try --numa=interleave)\n", nodes[i]);
+				replicas.push_back(&P);
+			}
+		}
+	}
+
+	report_alloc();
+	solve_input(P, replicas, nodes, upgrade);
+}
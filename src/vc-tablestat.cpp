@@ -0,0 +1,315 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Reports statistics of a pruning table: the kinds of its entries, the
+ * distribution of their lower bounds and of the stripe minimums, and the
+ * lower bound for random cubes.
+ */
+
+#include <cstdio>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <getopt.h>
+#include <libgen.h>
+#include "nxprune.h"
+#include "nxvariant.h"
+
+using namespace vcube;
+
+/* Configuration */
+static struct {
+	std::string path;
+	uint32_t workers;
+	uint32_t coord;
+	uint32_t base;
+	bool exact;
+	uint64_t samples;
+	bool rows;
+} cf;
+
+static constexpr int MAX_DEPTH = 16;
+using histogram_t = std::array<uint64_t, MAX_DEPTH>;
+
+static void print_histogram(const char *title, const histogram_t &h) {
+	uint64_t total = 0, sum = 0;
+	for (int d = 0; d < MAX_DEPTH; d++) {
+		total += h[d];
+		sum += d * h[d];
+	}
+	printf("%s (mean %.4f)\n", title, total ? double(sum) / total : 0.0);
+	for (int d = 0; d < MAX_DEPTH; d++) {
+		if (h[d]) {
+			printf("  %2d %16lu %10.6f%%\n", d, h[d], 100.0 * h[d] / total);
+		}
+	}
+}
+
+template<typename Prune>
+static bool tablestat(const std::string &table_filename) {
+	constexpr int Base = Prune::BASE;
+	Prune P;
+
+	nx::table_options opt;
+	opt.n_threads = cf.workers;
+	std::string table_fullpath = cf.path + "/" + table_filename;
+	if (!P.load(table_fullpath, opt)) {
+		fprintf(stderr, "Could not load %s\n", table_fullpath.c_str());
+		return false;
+	}
+
+	// Rows are reported in sym-coordinate order
+	P.reorder(nx::table_options::ROWS_NATURAL);
+
+	// Entries are decoded as the solver reads them, into the range of
+	// distances they stand for.  Entries of a derived table are lower
+	// bounds only.
+	enum { EXACT, BOUNDED, OPEN, N_KIND };
+	const size_t n_stripes = Prune::N_EDGE_STRIPE;
+	const uint8_t *mem = P.data();
+	const bool derived = P.derived();
+	std::array<uint64_t, N_KIND> kind_count = {};
+	histogram_t entry_depth = {}, stripe_min = {};
+	std::vector<histogram_t> row_depth(cf.rows ? nx::N_CORNER_SYM : 0);
+	std::atomic<uint32_t> next_row(0);
+	std::mutex mtx;
+
+	std::vector<std::thread> workers;
+	for (uint32_t i = 0; i < cf.workers; i++) {
+		workers.push_back(std::thread([&]() {
+					std::array<uint64_t, N_KIND> kinds = {};
+					histogram_t depth = {}, mins = {};
+					for (uint32_t row; (row = next_row++) < nx::N_CORNER_SYM; ) {
+						histogram_t row_hist = {};
+						auto stripe = mem + row * n_stripes * Prune::STRIPE_BYTES;
+						for (size_t s = 0; s < n_stripes; s++, stripe += Prune::STRIPE_BYTES) {
+							// Entries 0 and 1 of each stripe and 511 are
+							// unused (see ecoord)
+							uint32_t end = (s % 8 == 7) ? 63 : 64;
+							uint8_t min = MAX_DEPTH - 1;
+							for (uint32_t e = 2; e < end; e++) {
+								auto b = Prune::encoding::template bounds<Base>(stripe, e);
+								if (derived) {
+									b.second = 0xff;
+								}
+								kinds[b.first == b.second ? EXACT : b.second == 0xff ? OPEN : BOUNDED]++;
+								row_hist[b.first]++;
+								min = std::min(min, b.first);
+							}
+							mins[min]++;
+						}
+						for (int d = 0; d < MAX_DEPTH; d++) {
+							depth[d] += row_hist[d];
+						}
+						if (cf.rows) {
+							row_depth[row] = row_hist;
+						}
+					}
+
+					std::lock_guard<std::mutex> lock(mtx);
+					for (int k = 0; k < N_KIND; k++) {
+						kind_count[k] += kinds[k];
+					}
+					for (int d = 0; d < MAX_DEPTH; d++) {
+						entry_depth[d] += depth[d];
+						stripe_min[d] += mins[d];
+					}
+					}));
+	}
+	for (auto &t : workers) {
+		t.join();
+	}
+
+	static const char *kind_name[N_KIND] = {
+		"exact distance",
+		"between the stripe minimum and base",
+		"lower bound only",
+	};
+	uint64_t n_entries = kind_count[EXACT] + kind_count[BOUNDED] + kind_count[OPEN];
+	printf("Table %s: coord %u, base %d, %s, %lu entries\n", table_filename.c_str(), cf.coord, Base,
+			Prune::encoding::ID == nx::encoding_exact::ID ? "exact" : "2-bit", n_entries);
+	if (derived) {
+		printf("Derived from a larger table\n");
+	}
+	printf("Entries\n");
+	for (int k = 0; k < N_KIND; k++) {
+		printf("  %16lu %10.6f%%  %s\n", kind_count[k], 100.0 * kind_count[k] / n_entries, kind_name[k]);
+	}
+	print_histogram("Stripe minimum lower bound", stripe_min);
+	print_histogram("Entry lower bound", entry_depth);
+
+	if (cf.rows) {
+		printf("Mean lower bound by corner sym-coordinate\n");
+		for (uint32_t row = 0; row < nx::N_CORNER_SYM; row++) {
+			uint64_t total = 0, sum = 0;
+			for (int d = 0; d < MAX_DEPTH; d++) {
+				total += row_depth[row][d];
+				sum += d * row_depth[row][d];
+			}
+			printf("  %4u %.4f\n", row, double(sum) / total);
+		}
+	}
+
+	// Lower bound of uniformly random cubes, which is what the search
+	// starts from (and differs from the entry mean, since each cube
+	// takes the max over three axes and the inverse)
+	if (cf.samples) {
+		histogram_t sample_depth = {};
+		std::mt19937_64 rng(1);
+		for (uint64_t i = 0; i < cf.samples; i++) {
+			cube c;
+			c.setEdgePerm(rng() % N_EPERM);
+			c.setEdgeOrient(rng() % N_EORIENT);
+			c.setCornerOrient(rng() % N_CORIENT);
+			do {
+				c.setCornerPerm(rng() % N_CPERM);
+			} while (c.parity());
+			sample_depth[std::min<int>(P.initial_depth(c), MAX_DEPTH - 1)]++;
+		}
+		print_histogram("Random cube lower bound", sample_depth);
+	}
+
+	return true;
+}
+
+struct variant : nx::table_variant {
+	bool (*func)(const std::string &);
+};
+
+/* The variants of nx::for_each_variant, as built into vc-optimal */
+static std::vector<variant> make_variants() {
+	std::vector<variant> list;
+	nx::for_each_variant([&](auto v) {
+		using Variant = decltype(v);
+		list.push_back({
+			nx::table_variant::make<Variant>(),
+			tablestat<typename Variant::prune>
+		});
+	});
+	return list;
+}
+
+static std::vector<variant> variants = make_variants();
+
+static void usage(const char *argv0, int status = EXIT_FAILURE) {
+	fprintf(stdout, "Usage: %s [OPTION]...\n", argv0);
+	fputs(	 /**********************************************************************/
+		"Report statistics of a generated pruning table.\n"
+		"\n"
+		"Options:\n"
+		"  -h, --help\n"
+		"  -c, --coord=COORD           pruning coordinate variant\n"
+		"  -b, --base=BASE             pruning table base depth, instead of the one\n"
+		"                              chosen for the variant\n"
+		"      --exact                 read the table of exact distances\n"
+		"  -r, --rows                  report the mean per corner sym-coordinate\n"
+		"  -s, --samples=NUM           random cubes to sample (default: 1000000)\n"
+		"  -w, --workers=NUM           worker count (default: cpu core count)\n"
+		"\n"
+		"Pruning coordinate variants (COORD):\n",
+		stdout);
+	std::sort(variants.begin(), variants.end());
+	std::set<std::pair<int, bool>> listed;
+	for (auto &v : variants) {
+		if (listed.insert({ v.id, v.exact }).second) {
+			fprintf(stdout, "  %4d%s (%s)\n", v.id, v.exact ? " --exact" : "",
+					nx::variant_bases(variants, v.id, v.exact).c_str());
+		}
+	}
+	exit(status);
+}
+
+static std::string base_path(const char *argv0) {
+	char *tmp = realpath(argv0, NULL);
+	if (!tmp) {
+		perror("realpath");
+		exit(EXIT_FAILURE);
+	}
+	std::string path(dirname(tmp));
+	free(tmp);
+	return path;
+}
+
+int main(int argc, char * const *argv) {
+	cf.path = base_path(argv[0]);
+	cf.workers = std::max(1U, std::thread::hardware_concurrency());
+	cf.coord = 308;
+	cf.base = 0;
+	cf.exact = false;
+	cf.samples = 1000000;
+	cf.rows = false;
+
+	for (;;) {
+		static struct option long_options[] = {
+			{ "base",     required_argument, 0, 'b' },
+			{ "coord",    required_argument, 0, 'c' },
+			{ "exact",    no_argument,       0, 'E' },
+			{ "help",     no_argument,       0, 'h' },
+			{ "rows",     no_argument,       0, 'r' },
+			{ "samples",  required_argument, 0, 's' },
+			{ "workers",  required_argument, 0, 'w' },
+			{ 0, 0, 0, 0 }
+		};
+
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "b:c:hrs:w:", long_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+
+		switch (c) {
+		    case 'b':
+			cf.base = strtoul(optarg, NULL, 10);
+			break;
+		    case 'c':
+			cf.coord = strtoul(optarg, NULL, 10);
+			break;
+		    case 'E':
+			cf.exact = true;
+			break;
+		    case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+			break;
+		    case 'r':
+			cf.rows = true;
+			break;
+		    case 's':
+			cf.samples = strtoull(optarg, NULL, 10);
+			break;
+		    case 'w':
+			cf.workers = std::max(1UL, strtoul(optarg, NULL, 10));
+			break;
+		    default:
+			usage(argv[0]);
+		}
+	}
+
+	if (auto v = nx::find_variant(variants, cf.coord, cf.exact, cf.base)) {
+		return v->func(v->filename) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	nx::report_missing_variant(variants, cf.coord, cf.exact, cf.base);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,356 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Measures the solver at candidate Base values of a pruning table variant
+ * over a fixed corpus of cubes, to choose the Base for vc-optimal.
+ */
+
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <getopt.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+#include "nxprune.h"
+#include "nxprune_generator.h"
+#include "nxsolve.h"
+#include "nxvariant.h"
+
+using namespace vcube;
+
+/* Configuration */
+static struct {
+	std::string path;
+	uint32_t workers;
+	uint32_t coord;
+	std::vector<int> bases;
+	size_t count;
+	bool corners;
+	bool cluster_rows;
+} cf;
+
+/* Totals over the corpus, passed from the child process measuring one
+ * candidate back to the parent
+ */
+struct result_t {
+	uint64_t n_cubes;
+	uint64_t lookups;
+	uint64_t nodes;
+	double seconds;  // sum of per-cube solve times
+	int64_t dtlb_misses; // -1 if not available
+};
+
+/* Counts the dTLB load misses of this process and of the threads it
+ * starts afterward, where the CPU and kernel allow it (not in most
+ * virtual machines)
+ */
+class dtlb_counter {
+	int fd;
+
+    public:
+	dtlb_counter() {
+		perf_event_attr attr = {};
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_DTLB |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+
+	~dtlb_counter() {
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+
+	/* Threads' counts are included once they have exited */
+	int64_t get() const {
+		uint64_t n;
+		return (fd != -1 && read(fd, &n, sizeof(n)) == sizeof(n)) ? int64_t(n) : -1;
+	}
+};
+
+struct candidate : nx::table_variant {
+	bool (*func)(const std::string &, const std::vector<cube> &, result_t &);
+};
+
+template<typename ECoord, int Base>
+static bool measure(const std::string &table_filename, const std::vector<cube> &corpus, result_t &res) {
+	using Prune = nx::prune<ECoord, Base>;
+	Prune P;
+
+	nx::table_options opt;
+	opt.n_threads = cf.workers;
+	std::string table_fullpath = cf.path + "/" + table_filename;
+	if (!P.load(table_fullpath, opt)) {
+		nx::prune_generator gen(P, cf.workers);
+		gen.generate();
+		if (!P.save(table_fullpath, opt)) {
+			fprintf(stderr, "Could not save %s\n", table_fullpath.c_str());
+		}
+	}
+
+	P.reorder(cf.cluster_rows ? nx::table_options::ROWS_CLUSTERED : nx::table_options::ROWS_NATURAL);
+
+	nx::corner_table corners;
+	if (cf.corners) {
+		corners.generate(cf.workers);
+		P.setCornerTable(&corners);
+	}
+
+	nx::solver_base::init();
+
+	dtlb_counter dtlb;
+	int64_t dtlb_start = dtlb.get();
+
+	std::atomic<size_t> next(0);
+	std::vector<result_t> partial(cf.workers, result_t{});
+	std::vector<std::thread> workers;
+	for (uint32_t i = 0; i < cf.workers; i++) {
+		workers.push_back(std::thread([&, i]() {
+					nx::solver S(P);
+					for (size_t id; (id = next++) < corpus.size(); ) {
+						auto t0 = std::chrono::steady_clock::now();
+						S.solve(corpus[id]);
+						std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+						partial[i].n_cubes++;
+						partial[i].lookups += S.lookups();
+						partial[i].nodes += S.cost();
+						partial[i].seconds += elapsed.count();
+					}
+					}));
+	}
+	for (auto &t : workers) {
+		t.join();
+	}
+	int64_t dtlb_end = dtlb.get();
+
+	res = {};
+	res.dtlb_misses = (dtlb_start == -1 || dtlb_end == -1) ? -1 : dtlb_end - dtlb_start;
+	for (auto &r : partial) {
+		res.n_cubes += r.n_cubes;
+		res.lookups += r.lookups;
+		res.nodes += r.nodes;
+		res.seconds += r.seconds;
+	}
+	return true;
+}
+
+/* The 2-bit variants of nx::for_each_variant, at the Bases vc-optimal is
+ * built with
+ */
+static std::vector<candidate> make_candidates() {
+	std::vector<candidate> list;
+	nx::for_each_variant([&](auto variant) {
+		using Variant = decltype(variant);
+		using Prune = typename Variant::prune;
+		if constexpr (!Variant::EXACT) {
+			list.push_back({
+				nx::table_variant::make<Variant>(),
+				measure<typename Prune::ecoord, Prune::BASE>
+			});
+		}
+	});
+	return list;
+}
+
+static std::vector<candidate> candidates = make_candidates();
+
+/* Each candidate is measured in a child process, so its table memory is
+ * released before the next one is loaded
+ */
+static bool run(const candidate &c, const std::vector<cube> &corpus, result_t &res) {
+	int fd[2];
+	if (pipe(fd) == -1) {
+		return false;
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) {
+		return false;
+	} else if (pid == 0) {
+		close(fd[0]);
+		bool ok = c.func(c.filename, corpus, res);
+		_exit(ok && write(fd[1], &res, sizeof(res)) == sizeof(res) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	close(fd[1]);
+	bool ok = read(fd[0], &res, sizeof(res)) == sizeof(res);
+	close(fd[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	return ok && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+static void usage(const char *argv0, int status = EXIT_FAILURE) {
+	fprintf(stdout, "Usage: %s [OPTION]... < CORPUS\n", argv0);
+	fputs(	 /**********************************************************************/
+		"Measure solver performance at candidate Base values of a pruning table\n"
+		"variant, and recommend the fastest.  The corpus is read from standard\n"
+		"input, one move sequence per line.  Missing tables are generated.\n"
+		"\n"
+		"Options:\n"
+		"  -h, --help\n"
+		"  -c, --coord=COORD           pruning coordinate variant\n"
+		"  -C, --corners               also prune with the exact corner table\n"
+		"  -b, --base=BASE[,BASE]...   candidate Base values (default: all)\n"
+		"  -n, --count=NUM             use only the first NUM cubes of the corpus\n"
+		"  -R, --cluster-rows          measure with the clustered row order\n"
+		"  -w, --workers=NUM           worker count (default: cpu core count)\n"
+		"\n"
+		"Candidates:\n", stdout);
+	for (auto &c : candidates) {
+		fprintf(stdout, "  %d base %2d  %8.3f GiB%s\n", c.id, c.base, double(c.size) / (1 << 30),
+				c.preferred ? "  [chosen]" : "");
+	}
+	exit(status);
+}
+
+static std::string base_path(const char *argv0) {
+	char *tmp = realpath(argv0, NULL);
+	if (!tmp) {
+		perror("realpath");
+		exit(EXIT_FAILURE);
+	}
+	std::string path(dirname(tmp));
+	free(tmp);
+	return path;
+}
+
+int main(int argc, char * const *argv) {
+	cf.path = base_path(argv[0]);
+	cf.workers = std::max(1U, std::thread::hardware_concurrency());
+	cf.coord = 308;
+	cf.count = SIZE_MAX;
+	cf.corners = false;
+	cf.cluster_rows = false;
+
+	for (;;) {
+		static struct option long_options[] = {
+			{ "base",     required_argument, 0, 'b' },
+			{ "coord",    required_argument, 0, 'c' },
+			{ "corners",  no_argument,       0, 'C' },
+			{ "cluster-rows", no_argument,   0, 'R' },
+			{ "count",    required_argument, 0, 'n' },
+			{ "help",     no_argument,       0, 'h' },
+			{ "workers",  required_argument, 0, 'w' },
+			{ 0, 0, 0, 0 }
+		};
+
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "b:Cc:hn:Rw:", long_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+
+		switch (c) {
+		    case 'b':
+			for (char *s = optarg, *end; *s; s = end + (*end == ',')) {
+				cf.bases.push_back(strtol(s, &end, 10));
+				if (end == s) {
+					usage(argv[0]);
+				}
+			}
+			break;
+		    case 'C':
+			cf.corners = true;
+			break;
+		    case 'c':
+			cf.coord = strtoul(optarg, NULL, 10);
+			break;
+		    case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+			break;
+		    case 'n':
+			cf.count = strtoul(optarg, NULL, 10);
+			break;
+		    case 'R':
+			cf.cluster_rows = true;
+			break;
+		    case 'w':
+			cf.workers = std::max(1UL, strtoul(optarg, NULL, 10));
+			break;
+		    default:
+			usage(argv[0]);
+		}
+	}
+
+	std::vector<cube> corpus;
+	char buf[1024];
+	while (corpus.size() < cf.count && fgets(buf, sizeof(buf), stdin)) {
+		corpus.push_back(cube::from_moves(buf));
+	}
+	if (corpus.empty()) {
+		fprintf(stderr, "The corpus is empty\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("coord base        size  lookups/cube    nodes/cube  seconds/cube  dTLB-misses/cube\n");
+	const candidate *best = nullptr;
+	double best_seconds = 0;
+	for (auto &c : candidates) {
+		if (c.id != int(cf.coord) || (!cf.bases.empty() &&
+			std::find(cf.bases.begin(), cf.bases.end(), c.base) == cf.bases.end()))
+		{
+			continue;
+		}
+
+		result_t res;
+		if (!run(c, corpus, res) || res.n_cubes == 0) {
+			printf("%5d %4d  %7.3f GiB  failed\n", c.id, c.base, double(c.size) / (1 << 30));
+			continue;
+		}
+
+		double seconds = res.seconds / res.n_cubes;
+		printf("%5d %4d  %7.3f GiB  %12.0f  %12.0f  %12.6f", c.id, c.base,
+				double(c.size) / (1 << 30),
+				double(res.lookups) / res.n_cubes,
+				double(res.nodes) / res.n_cubes,
+				seconds);
+		if (res.dtlb_misses >= 0) {
+			printf("  %16.0f\n", double(res.dtlb_misses) / res.n_cubes);
+		} else {
+			printf("  %16s\n", "n/a");
+		}
+		if (!best || seconds < best_seconds) {
+			best = &c;
+			best_seconds = seconds;
+		}
+	}
+
+	if (!best) {
+		fprintf(stderr, "No candidates for coord %u\n", cf.coord);
+		return EXIT_FAILURE;
+	}
+	printf("Recommended base for %d: %d\n", best->id, best->base);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "alloc.h"
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include "CppUTest/TestHarness.h"
+
+using namespace vcube;
+
+TEST_GROUP(Alloc) {
+	size_t total(const alloc::stats_t &st) {
+		return st.bytes_4k + st.bytes_2m + st.bytes_1g;
+	}
+};
+
+TEST(Alloc, Anonymous) {
+	size_t before = total(alloc::stats());
+	{
+		auto b = alloc::anonymous(3 << 20);
+		CHECK(b);
+		CHECK_EQUAL(3u << 20, b.size());
+		CHECK(b.page_size() >= 4096);
+		memset(b.get(), 0x55, b.size());
+		CHECK_EQUAL(before + (3 << 20), total(alloc::stats()));
+		CHECK(alloc::stats().peak >= total(alloc::stats()));
+
+		// Ownership moves with the block
+		alloc::block c = std::move(b);
+		CHECK(!b);
+		CHECK_EQUAL(0x55, c.get()[(3 << 20) - 1]);
+		CHECK_EQUAL(before + (3 << 20), total(alloc::stats()));
+	}
+	CHECK_EQUAL(before, total(alloc::stats()));
+}
+
+TEST(Alloc, Policy) {
+	auto saved = alloc::policy;
+	alloc::policy.backend = alloc::TRANSPARENT;
+	alloc::policy.lock = true;
+
+	size_t locked = alloc::stats().locked;
+	auto b = alloc::anonymous(1 << 20);
+	CHECK(b);
+	CHECK_EQUAL(alloc::TRANSPARENT, b.backend());
+	CHECK_EQUAL(4096u, b.page_size());
+	// Locking is subject to RLIMIT_MEMLOCK
+	CHECK_EQUAL(locked + (b.locked() ? b.size() : 0), alloc::stats().locked);
+	b.reset();
+	CHECK_EQUAL(locked, alloc::stats().locked);
+
+	alloc::policy = saved;
+}
+
+TEST(Alloc, File) {
+	char name[] = "/tmp/vcube-alloc-XXXXXX";
+	int fd = mkstemp(name);
+	CHECK(fd != -1);
+	unlink(name);
+	CHECK(write(fd, "headerdata", 10) == 10);
+
+	auto b = alloc::file(fd, 6, 4, false);
+	close(fd);
+	CHECK(b);
+	CHECK_EQUAL(alloc::FILE, b.backend());
+	CHECK_EQUAL(4u, b.size());
+	CHECK(!memcmp(b.get(), "data", 4));
+}
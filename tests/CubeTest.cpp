@@ -613,6 +613,31 @@ TEST(Cube, Corner4Comb) {
 	}
 }
 
+TEST(Cube, CornerUDCycle) {
+	cube c;
+
+	LONGS_EQUAL(0, c.getCornerUDCycle());
+
+	for (int i = 0; i < 1000; i++) {
+		c = t::random_cube();
+		c4comb_t c4comb = c.getCorner4Comb();
+		corient_t corient = c.getCornerOrient();
+		cudcycle_t cudcycle = t::rand(N_CUDCYCLE);
+		c.setCornerUDCycle(cudcycle);
+		LONGS_EQUAL(cudcycle, c.getCornerUDCycle());
+		LONGS_EQUAL(c4comb, c.getCorner4Comb());
+		LONGS_EQUAL(corient, c.getCornerOrient());
+		check_invariants(c);
+	}
+
+	/* Turning the U-face or D-face corners should not affect the coordinate */
+	for (int i = 0; i < 1000; i++) {
+		c = t::random_cube();
+		CHECK(c.getCornerUDCycle() == c.premove(0).getCornerUDCycle());
+		CHECK(c.getCornerUDCycle() == c.premove(9).getCornerUDCycle());
+	}
+}
+
 TEST(Cube, Edge4Comb) {
 	cube c;
 
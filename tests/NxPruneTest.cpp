@@ -17,7 +17,14 @@
  */
 
 #include "nxprune.h"
-
+#include "nxdisk.h"
+#include "nxprune_generator.h"
+#include "nxprune_checker.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
 #include "test_util.h"
 #include "CppUTest/TestHarness.h"
 
@@ -225,3 +232,409 @@ TEST(NxPrune, EO12) {
 		LONGS_EQUAL(i, (ecoord(c) >> 9) & 0x7ff);
 	}
 }
+
+TEST(NxPrune, TableFile) {
+	using Prune = nx::prune<nx::ecoord<nx::EP1, nx::EO4>, 7>;
+	const std::string hdr = t::temp_file();
+
+	nx::table_options opt;
+	opt.n_threads = 2;
+	opt.verify = nx::table_options::VERIFY_ALWAYS;
+
+	/* Tables without a header are accepted */
+	Prune P;
+	std::vector<uint8_t> data = t::random_table(P);
+	CHECK(!data.empty());
+	CHECK(P.legacy());
+
+	/* Round trip with a header */
+	CHECK(P.save(hdr, opt));
+	Prune P2;
+	CHECK(P2.load(hdr, opt));
+	CHECK(!P2.legacy());
+	CHECK(P2.verify(hdr, opt));
+
+	/* Round trip compressed */
+	opt.compress = true;
+	CHECK(P2.save(hdr, opt));
+	Prune P4;
+	CHECK(P4.load(hdr, opt));
+	CHECK(P4.compressed());
+	CHECK(P4.verify(hdr, opt));
+	CHECK(!P4.loadMapped(hdr, opt));
+	opt.compress = false;
+	CHECK(P4.save(hdr, opt));
+
+	/* Wrong base or variant is rejected */
+	nx::prune<nx::ecoord<nx::EP1, nx::EO4>, 8> P_base;
+	CHECK(!P_base.load(hdr, opt));
+
+	/* Corrupt table data is detected */
+	FILE *fp = fopen(hdr.c_str(), "r+");
+	fseek(fp, -1000, SEEK_END);
+	fputc(~data[data.size() - 1000], fp);
+	fclose(fp);
+	Prune P3;
+	CHECK(!P3.load(hdr, opt));
+	opt.verify = nx::table_options::VERIFY_NEVER;
+	CHECK(P3.load(hdr, opt));
+
+	/* Truncated files are rejected */
+	CHECK(truncate(hdr.c_str(), 4096 + P.size() - 4096) == 0);
+	CHECK(!P3.load(hdr, opt));
+
+	unlink(hdr.c_str());
+}
+
+/* Moves to solve the corners if at most "limit", otherwise limit + 1 */
+static int corner_distance(const cube &c, int limit, int last_face = -1) {
+	if (c.getCornerPerm() == 0 && c.getCornerOrient() == 0) {
+		return 0;
+	}
+	int d = limit + 1;
+	for (int m = 0; m < N_MOVES && limit > 0; m++) {
+		int face = m / 3;
+		if (face == last_face || face + 3 == last_face) {
+			continue;
+		}
+		d = std::min(d, 1 + corner_distance(c.move(m), std::min(limit, d - 1) - 1, face));
+	}
+	return d;
+}
+
+TEST(NxPrune, CornerTable) {
+	/* Five moves is enough to check the search against brute force;
+	 * the positions beyond it stand for 6
+	 */
+	const int max_depth = 5;
+	nx::corner_table ct;
+	ct.generate(2, max_depth);
+
+	auto dist = [&](const cube &c) {
+		return ct.get(nx::corner_table::index(c));
+	};
+
+	LONGS_EQUAL(0, dist(cube()));
+	for (int m = 0; m < N_MOVES; m++) {
+		LONGS_EQUAL(1, dist(cube().move(m)));
+	}
+	LONGS_EQUAL(2, dist(cube::from_moves("R U")));
+
+	/* Short move sequences have their exact distances */
+	for (int i = 0; i < 200; i++) {
+		cube c;
+		int len = 1 + t::rand(max_depth);
+		for (int j = 0; j < len; j++) {
+			c = c.move(t::rand(N_MOVES));
+		}
+		LONGS_EQUAL(corner_distance(c, max_depth), dist(c));
+	}
+
+	/* Distances are consistent, and the same for the inverse */
+	for (int i = 0; i < 1000; i++) {
+		cube c = t::random_cube();
+		int d = dist(c);
+		CHECK(d <= max_depth + 1);
+		LONGS_EQUAL(d, dist(~c));
+		for (int m = 0; m < N_MOVES; m++) {
+			CHECK(abs(dist(c.move(m)) - d) <= 1);
+		}
+	}
+}
+
+TEST(NxPrune, LookupMany) {
+	using Prune = nx::prune<nx::ecoord<nx::EP1, nx::EO4>, 7>;
+
+	/* Random table contents are enough to compare the two lookups */
+	Prune P;
+	CHECK(!t::random_table(P).empty());
+
+	std::vector<cube6> c6(1000);
+	for (auto &c : c6) {
+		c = t::random_cube();
+	}
+	c6[0] = cube();
+	std::vector<uint8_t> depth(c6.size());
+	P.lookup_many(c6.data(), c6.size(), depth.data());
+	for (size_t i = 0; i < c6.size(); i++) {
+		LONGS_EQUAL(P.initial_depth(c6[i]), depth[i]);
+	}
+}
+
+TEST(NxPrune, RowOrder) {
+	using Prune = nx::prune<nx::ecoord<nx::EP1, nx::EO4>, 7>;
+	const std::string hdr = t::temp_file();
+
+	Prune P;
+	std::vector<uint8_t> data = t::random_table(P);
+	CHECK(!data.empty());
+
+	std::vector<cube> cubes(1000);
+	std::vector<uint8_t> depth(cubes.size());
+	for (size_t i = 0; i < cubes.size(); i++) {
+		cubes[i] = t::random_cube();
+		depth[i] = P.initial_depth(cubes[i]);
+	}
+
+	/* Lookups are unchanged by the row order, which is saved with the table */
+	P.reorder(nx::table_options::ROWS_CLUSTERED);
+	CHECK(memcmp(P.data(), data.data(), data.size()) != 0);
+	CHECK(P.save(hdr));
+	Prune P2;
+	CHECK(P2.load(hdr));
+	LONGS_EQUAL(nx::table_options::ROWS_CLUSTERED, P2.rowOrder());
+	for (size_t i = 0; i < cubes.size(); i++) {
+		LONGS_EQUAL(depth[i], P.initial_depth(cubes[i]));
+		LONGS_EQUAL(depth[i], P2.initial_depth(cubes[i]));
+	}
+
+	P2.reorder(nx::table_options::ROWS_NATURAL);
+	CHECK(memcmp(P2.data(), data.data(), data.size()) == 0);
+	CHECK(!P2.verify(hdr));
+
+	unlink(hdr.c_str());
+}
+
+/* The complete exact 104 table takes a while to generate, so the tests
+ * that need one share it
+ */
+using ExactPrune = nx::prune<nx::ecoord<nx::EP1, nx::EO4>, 7, nx::encoding_exact>;
+
+static ExactPrune &exact_table() {
+	static ExactPrune P;
+	if (!P.data()) {
+		nx::prune_generator gen(P, 2);
+		gen.generate();
+	}
+	return P;
+}
+
+TEST(NxPrune, DiskTable) {
+	using ECoord = nx::ecoord<nx::EP1, nx::EO4>;
+	const std::string hdr = t::temp_file();
+
+	nx::prune<ECoord, 7> P;
+	CHECK(!t::random_table(P).empty());
+	P.reorder(nx::table_options::ROWS_CLUSTERED);
+	CHECK(P.save(hdr));
+
+	std::vector<cube6> c6(1000);
+	for (auto &c : c6) {
+		c = t::random_cube();
+	}
+
+	/* Same values with all rows on disk, and with part of them cached */
+	for (size_t cache : { size_t(0), P.size() / 3 }) {
+		nx::disk_prune<ECoord, 7> D;
+		CHECK(D.open(hdr, {}, cache));
+		CHECK(D.cached() <= cache);
+
+		std::vector<uint8_t> depth(c6.size());
+		D.lookup_many(c6.data(), c6.size(), depth.data());
+		for (size_t i = 0; i < c6.size(); i++) {
+			LONGS_EQUAL(P.initial_depth(c6[i]), D.initial_depth(c6[i]));
+			LONGS_EQUAL(P.initial_depth(c6[i]), depth[i]);
+		}
+		CHECK(D.reads() > 0);
+		LONGS_EQUAL(0, D.errors());
+	}
+
+	/* Exact tables are read with their own encoding */
+	const ExactPrune &P_exact = exact_table();
+	CHECK(P_exact.save(hdr));
+	nx::disk_prune<ECoord, 7> D_2bit;
+	CHECK(!D_2bit.open(hdr, {}, 0));
+	nx::disk_prune<ECoord, 7, nx::encoding_exact> D_exact;
+	CHECK(D_exact.open(hdr, {}, 0));
+	for (size_t i = 0; i < c6.size(); i++) {
+		LONGS_EQUAL(P_exact.initial_depth(c6[i]), D_exact.initial_depth(c6[i]));
+	}
+
+	unlink(hdr.c_str());
+}
+
+TEST(NxPrune, Derive) {
+	using ECoord = nx::ecoord<nx::EP1, nx::EO4>;
+	using Source = nx::prune<nx::ecoord<nx::EP2, nx::EO4>, 3>;
+	using Prune = nx::prune<ECoord, 3>;
+	const std::string hdr = t::temp_file(), derived = t::temp_file();
+
+	CHECK((nx::prune_deriver<Prune, Source>::VALID));
+	CHECK(!(nx::prune_deriver<Source, Prune>::VALID));
+	// The other eight edges' orientation does not determine the E-layer's
+	CHECK(!(nx::prune_deriver<Prune, nx::prune<nx::ecoord<nx::EP2, nx::EO8>, 9>>::VALID));
+
+	{
+		Source S;
+		nx::prune_generator gen(S, 2);
+		gen.generate();
+		S.reorder(nx::table_options::ROWS_CLUSTERED);
+		CHECK(S.save(hdr));
+	}
+
+	Prune P;
+	nx::prune_deriver<Prune, Source> deriver(P, 2);
+	CHECK(deriver.derive(hdr, {}));
+	CHECK(P.derived());
+
+	/* Below the source's base, derived entries are only lower bounds,
+	 * which the checker accepts
+	 */
+	nx::prune<ECoord, 2> P_low;
+	nx::prune_deriver<decltype(P_low), Source> deriver_low(P_low, 2);
+	CHECK(deriver_low.derive(hdr, {}));
+	nx::prune_checker checker(P_low, 2, 4);
+	LONGS_EQUAL(0, checker.check(std::chrono::minutes(1), 2000).errors);
+	unlink(hdr.c_str());
+
+	/* With the same base, the projection of a generated table has the
+	 * generated table's values; only the stripe minimums (used where a
+	 * value is 0) may be weaker
+	 */
+	Prune P_gen;
+	nx::prune_generator gen(P_gen, 2);
+	gen.generate();
+	auto has_zero = [](const uint8_t *stripe) {
+		for (int i = 2; i < 64; i++) {
+			if (!((stripe[i / 4] >> (i % 4 * 2)) & 3)) {
+				return true;
+			}
+		}
+		return false;
+	};
+	const uint8_t *d = P.data(), *g = P_gen.data();
+	size_t n_above = 0, n_differ = 0;
+	for (size_t i = 0; i < P.size(); i += Prune::STRIPE_BYTES) {
+		n_above += has_zero(g + i) && (d[i] & 0xf) > (g[i] & 0xf);
+		n_differ += (d[i] & 0xf0) != (g[i] & 0xf0) ||
+			memcmp(d + i + 1, g + i + 1, Prune::STRIPE_BYTES - 1) != 0;
+	}
+	LONGS_EQUAL(0, n_above);
+	LONGS_EQUAL(0, n_differ);
+	for (int i = 0; i < 10000; i++) {
+		cube6 c = t::random_cube();
+		CHECK(P.initial_depth(c) <= P_gen.initial_depth(c));
+	}
+
+	CHECK(P.save(derived));
+	Prune P2;
+	CHECK(P2.load(derived));
+	CHECK(P2.derived());
+	CHECK(memcmp(P2.data(), P.data(), P.size()) == 0);
+
+	unlink(derived.c_str());
+}
+
+TEST(NxPrune, ExactEncoding) {
+	const std::string hdr = t::temp_file();
+
+	const ExactPrune &P = exact_table();
+	nx::prune<ExactPrune::ecoord, 7> P2;
+	LONGS_EQUAL(2 * P2.size(), P.size());
+	LONGS_EQUAL(P.size(), ExactPrune::SIZE);
+
+	/* Exact distances of neighbors differ by at most one on each axis
+	 * (of the cube, not of its inverse)
+	 */
+	for (int i = 0; i < 10000; i++) {
+		cube6 c6 = t::random_cube();
+		uint32_t prune_vals, prune_vals_m;
+		uint8_t axis_mask;
+		P.lookup(c6, 0xff, prune_vals, -1, 0, axis_mask);
+		for (int m = 0; m < N_MOVES; m++) {
+			P.lookup(c6.move(m), 0xff, prune_vals_m, -1, 0, axis_mask);
+			for (int axis = 0; axis < 3; axis++) {
+				int d = (prune_vals >> (4 * axis)) & 0xf;
+				int d_m = (prune_vals_m >> (4 * axis)) & 0xf;
+				CHECK(abs(d - d_m) <= 1);
+			}
+		}
+	}
+	LONGS_EQUAL(0, P.initial_depth(cube6(cube())));
+	LONGS_EQUAL(1, P.initial_depth(cube6(cube().move(0))));
+
+	/* The encoding is part of the table file header */
+	CHECK(P.save(hdr));
+	CHECK(!P2.load(hdr));
+	ExactPrune P3;
+	CHECK(P3.load(hdr));
+	CHECK(memcmp(P3.data(), P.data(), P.size()) == 0);
+
+	unlink(hdr.c_str());
+}
+
+TEST(NxPrune, CPCoord) {
+	using ECoord = nx::ecoord<nx::EP1, nx::EO4>;
+	using CPCoord = nx::cpcoord<ECoord>;
+
+	for (int i = 0; i < 1000; i++) {
+		cube c = t::random_cube();
+		int sym = t::rand(16);
+		LONGS_EQUAL(uint32_t(ECoord(c, sym)), CPCoord(c, sym) % ECoord::N_ECOORD);
+		LONGS_EQUAL(c.symConjugate(sym).getCornerUDCycle(), CPCoord(c, sym) / ECoord::N_ECOORD);
+
+		// Like the edge coordinate, unaffected by turning the U or D face first
+		LONGS_EQUAL(uint32_t(CPCoord(c)), uint32_t(CPCoord(c.premove(1))));
+		LONGS_EQUAL(uint32_t(CPCoord(c)), uint32_t(CPCoord(c.premove(11))));
+	}
+
+	/* The corner part round-trips without touching the edges */
+	for (int i = 0; i < 100; i++) {
+		cube c = t::random_cube();
+		for (uint32_t cp = 0; cp < CPCoord::N_CP; cp++) {
+			cube c_cp = CPCoord::setCP(c, cp);
+			LONGS_EQUAL(cp, CPCoord::getCP(c_cp));
+			LONGS_EQUAL(uint32_t(ECoord(c)), uint32_t(ECoord(c_cp)));
+			LONGS_EQUAL(cp * ECoord::N_ECOORD + ECoord(c), uint32_t(CPCoord(c_cp)));
+		}
+	}
+
+	/* A table truncated at a low base is enough to check the entries;
+	 * adding the corner order can only raise the lower bound
+	 */
+	nx::prune<ECoord, 2> P;
+	nx::prune<CPCoord, 2> P_cp;
+	LONGS_EQUAL(N_CUDCYCLE * P.size(), P_cp.size());
+	nx::prune_generator gen(P, 2);
+	gen.generate();
+	nx::prune_generator gen_cp(P_cp, 2);
+	gen_cp.generate();
+
+	for (int i = 0; i < 10000; i++) {
+		cube6 c6 = t::random_cube();
+		CHECK(P_cp.initial_depth(c6) >= P.initial_depth(c6));
+	}
+	LONGS_EQUAL(0, P_cp.initial_depth(cube6(cube())));
+	LONGS_EQUAL(1, P_cp.initial_depth(cube6(cube().move(0))));
+	LONGS_EQUAL(0, CPCoord::getCP(cube()));
+	for (uint32_t cp = 1; cp < CPCoord::N_CP; cp++) {
+		// Solved edges, but the corners out of order
+		cube6 c6 = CPCoord::setCP(cube(), cp);
+		CHECK(P_cp.initial_depth(c6) >= std::max(1, int(P.initial_depth(c6))));
+	}
+
+	nx::prune_checker checker(P_cp, 2, 4);
+	auto res = checker.check(std::chrono::minutes(1), 2000);
+	LONGS_EQUAL(2000, res.samples);
+	LONGS_EQUAL(0, res.errors);
+}
+
+TEST(NxPrune, Checker) {
+	ExactPrune &P = exact_table();
+	nx::prune_checker checker(P, 2);
+	auto res = checker.check(std::chrono::minutes(1), 2000);
+	LONGS_EQUAL(2000, res.samples);
+	CHECK(res.searched >= 1000);
+	LONGS_EQUAL(0, res.errors);
+
+	/* Damage a copy, not the shared table */
+	ExactPrune P2;
+	CHECK(P2.replicate(P));
+	P2.reorder(nx::table_options::ROWS_CLUSTERED);
+	nx::prune_checker checker2(P2, 2);
+	LONGS_EQUAL(0, checker2.check(std::chrono::minutes(1), 2000).errors);
+
+	/* Every entry in the first half of the table stands for 5 */
+	memset(const_cast<uint8_t *>(P2.data()), 0x55, P2.size() / 2);
+	CHECK(checker2.check(std::chrono::minutes(1), 2000).errors > 0);
+}
@@ -0,0 +1,328 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "nxsolve.h"
+#include "nxasync.h"
+#include "nxprune_generator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <set>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "test_util.h"
+#include "CppUTest/TestHarness.h"
+
+using namespace vcube;
+
+TEST_GROUP(NxSolve) {
+};
+
+/* A checkpoint taken partway through queue_search at depth 17 */
+static nx::solver_base::checkpoint_t queue_checkpoint() {
+	nx::solver_base::init();
+
+	nx::solver_base::checkpoint_t ck;
+	ck.c = t::random_cube();
+	ck.limit = 20;
+	ck.depth = 17;
+	ck.position = 1234;
+	ck.n_expands = 0x123456789ULL;
+	ck.n_lookups = 0x987654321ULL;
+	for (int i = 0; i < 43239; i++) {
+		ck.order.emplace_back(i, t::rand(65536));
+	}
+	for (int i = ck.order.size() - 1; i > 0; i--) {
+		std::swap(ck.order[i], ck.order[t::rand(i + 1)]);
+	}
+	return ck;
+}
+
+TEST(NxSolve, CheckpointRoundTrip) {
+	char filename[] = "/tmp/vcube-ckpt-XXXXXX";
+	int fd = mkstemp(filename);
+	CHECK(fd != -1);
+	close(fd);
+
+	nx::solver_base::checkpoint_t ck = queue_checkpoint(), ck2;
+	CHECK(ck.save(filename));
+	CHECK(ck2.load(filename));
+	unlink(filename);
+
+	CHECK(ck.c == ck2.c);
+	LONGS_EQUAL(ck.limit, ck2.limit);
+	LONGS_EQUAL(ck.depth, ck2.depth);
+	LONGS_EQUAL(ck.position, ck2.position);
+	CHECK(ck.n_expands == ck2.n_expands);
+	CHECK(ck.n_lookups == ck2.n_lookups);
+	LONGS_EQUAL(ck.order.size(), ck2.order.size());
+	for (size_t i = 0; i < ck.order.size(); i++) {
+		LONGS_EQUAL(ck.order[i].idx, ck2.order[i].idx);
+		LONGS_EQUAL(ck.order[i].density, ck2.order[i].density);
+	}
+}
+
+TEST(NxSolve, CheckpointInvalid) {
+	char filename[] = "/tmp/vcube-ckpt-XXXXXX";
+	int fd = mkstemp(filename);
+	CHECK(fd != -1);
+	close(fd);
+
+	nx::solver_base::checkpoint_t ck = queue_checkpoint(), ck2;
+	CHECK(ck.save(filename));
+	CHECK(ck2.load(filename));
+
+	// Position past the end of the queue
+	auto bad = ck;
+	bad.position = bad.order.size() + 1;
+	CHECK(bad.save(filename));
+	CHECK(!ck2.load(filename));
+
+	// Queue index out of range
+	bad = ck;
+	bad.order[5].idx = bad.order.size();
+	CHECK(bad.save(filename));
+	CHECK(!ck2.load(filename));
+
+	// Queue entry repeated (so another is never searched)
+	bad = ck;
+	bad.order[5].idx = bad.order[6].idx;
+	CHECK(bad.save(filename));
+	CHECK(!ck2.load(filename));
+
+	// Partial queue
+	bad = ck;
+	bad.order.resize(1000);
+	bad.position = 100;
+	CHECK(bad.save(filename));
+	CHECK(!ck2.load(filename));
+
+	unlink(filename);
+}
+
+TEST(NxSolve, CheckpointMissing) {
+	nx::solver_base::checkpoint_t ck;
+	CHECK(!ck.load("/nonexistent/vcube.ckpt"));
+}
+
+TEST(NxSolve, CheckpointResume) {
+	nx::prune<nx::ecoord<nx::EP1, nx::EO4>, 2> P;
+	nx::prune_generator gen(P, 2);
+	gen.generate();
+	nx::solver_base::init();
+
+	// 10 moves, so the solve reaches queue_search (from depth 7)
+	cube c = cube::from_moves("R U F' L2 D B' R2 U2 L F");
+	nx::solver<decltype(P)> S(P);
+	moveseq_t expected = S.solve(c);
+	LONGS_EQUAL(10, expected.size());
+	uint64_t cost = S.cost(), lookups = S.lookups();
+
+	char filename[] = "/tmp/vcube-ckpt-XXXXXX";
+	int fd = mkstemp(filename);
+	CHECK(fd != -1);
+	close(fd);
+
+	// Checkpoint at every step in a child process, and kill it once it
+	// is partway through queue_search
+	pid_t pid = fork();
+	CHECK(pid != -1);
+	if (pid == 0) {
+		S.set_checkpoint(filename, std::chrono::seconds(0));
+		S.solve(c);
+		_exit(0);
+	}
+	nx::solver_base::checkpoint_t ck;
+	while (!ck.load(filename) || ck.position == 0) {
+		CHECK(waitpid(pid, nullptr, WNOHANG) == 0);
+		usleep(1000);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, nullptr, 0);
+	unlink((filename + std::string(".tmp")).c_str());
+
+	// Resume from the last checkpoint the child saved
+	CHECK(ck.load(filename));
+	CHECK(!ck.order.empty());
+	CHECK(ck.n_expands < cost);
+	S.set_checkpoint(filename, std::chrono::seconds(3600));
+	CHECK(S.solve(c) == expected);
+	CHECK(S.cost() == cost);
+	CHECK(S.lookups() == lookups);
+	CHECK(access(filename, F_OK) != 0);
+}
+
+TEST(NxSolve, AsyncSolver) {
+	/* A low base is enough for short scrambles */
+	nx::prune<nx::ecoord<nx::EP1, nx::EO4>, 2> P;
+	nx::prune_generator gen(P, 2);
+	gen.generate();
+	nx::solver_base::init();
+
+	std::vector<cube> cubes;
+	for (int i = 0; i < 20; i++) {
+		cube c;
+		for (int len = 1 + t::rand(5); len > 0; len--) {
+			c = c.move(t::rand(N_MOVES));
+		}
+		cubes.push_back(c);
+	}
+
+	std::vector<std::future<moveseq_t>> futures;
+	std::atomic<int> n_callbacks(0);
+	{
+		nx::async_solver<decltype(P)> async(P, 2);
+		for (auto &c : cubes) {
+			futures.push_back(async.solve(c));
+			async.solve(c, 20, [&](moveseq_t) {
+					n_callbacks++;
+					});
+		}
+	}
+	LONGS_EQUAL(cubes.size(), n_callbacks);
+
+	nx::solver<decltype(P)> S(P);
+	for (size_t i = 0; i < cubes.size(); i++) {
+		moveseq_t moves = futures[i].get();
+		CHECK(moves == S.solve(cubes[i]));
+		CHECK(cubes[i] * cube::from_moveseq(moves) == cube());
+	}
+}
+
+/* Moves to solve c if at most "limit", otherwise limit + 1, with no move
+ * after last_face that the solver would not make
+ */
+static int distance(const cube &c, int limit, int last_face = -1) {
+	if (c == cube()) {
+		return 0;
+	}
+	int d = limit + 1;
+	for (int m = 0; m < N_MOVES && limit > 0; m++) {
+		int face = m / 3;
+		if (face == last_face || face + 3 == last_face) {
+			continue;
+		}
+		d = std::min(d, 1 + distance(c.move(m), std::min(limit, d - 1) - 1, face));
+	}
+	return d;
+}
+
+TEST(NxSolve, SearchPrefix) {
+	nx::prune<nx::ecoord<nx::EP1, nx::EO4>, 2> P;
+	nx::prune_generator gen(P, 2);
+	gen.generate();
+	nx::solver_base::init();
+	nx::solver<decltype(P)> S(P);
+
+	const char *scrambles[] = { "R U R' U'", "F R U' R' F'", "U D R2", "R2 L2 U2 D2" };
+	for (auto scramble : scrambles) {
+		cube c = cube::from_moves(scramble);
+		cube6 c6 = c;
+		int len = S.solve(c).size();
+		LONGS_EQUAL(distance(c, len), len);
+
+		/* At the optimal depth, as vc-optimal --diverse searches: each
+		 * solution starts with its move and solves the cube, and there
+		 * is one whenever brute force finds one
+		 */
+		std::set<uint8_t> first_moves;
+		for (int m = 0; m < N_MOVES; m++) {
+			moveseq_t moves;
+			bool found = S.search_prefix(c6, moveseq_t{ uint8_t(m) }, len, moves);
+			CHECK_EQUAL(1 + distance(c.move(m), len - 1, m / 3) == len, found);
+			if (found) {
+				LONGS_EQUAL(len, moves.size());
+				LONGS_EQUAL(m, moves[0]);
+				CHECK(c * cube::from_moveseq(moves) == cube());
+				moves = moves.canonical();
+				CHECK(first_moves.insert(moves[0]).second);
+			}
+		}
+		CHECK(!first_moves.empty());
+
+		/* The shortest solution starting with each move */
+		for (int m = 0; m < N_MOVES; m++) {
+			const int limit = len + 2;
+			moveseq_t moves;
+			int expect = 1 + distance(c.move(m), limit - 1, m / 3);
+			CHECK_EQUAL(expect <= limit, S.solve_prefix(c6, moveseq_t{ uint8_t(m) }, moves, limit));
+			if (expect <= limit) {
+				LONGS_EQUAL(expect, moves.size());
+				LONGS_EQUAL(m, moves[0]);
+				CHECK(c * cube::from_moveseq(moves) == cube());
+			}
+		}
+	}
+}
+
+TEST(NxSolve, SplitMerge) {
+	nx::prune<nx::ecoord<nx::EP1, nx::EO4>, 2> P;
+	nx::prune_generator gen(P, 2);
+	gen.generate();
+	nx::solver_base::init();
+	nx::solver<decltype(P)> S(P);
+
+	/* As vc-optimal --split=2, then --unit for every prefix, then
+	 * --merge: the merged solution is as short as a direct solve
+	 */
+	const uint32_t depth = 8;
+	const char *scrambles[] = { "R U R' U'", "F R U' R' F' D2", "L2 B' D R U2 F" };
+	for (auto scramble : scrambles) {
+		cube c = cube::from_moves(scramble);
+		cube6 c6 = c;
+		moveseq_t direct = S.solve(c);
+
+		nx::solver_base::merge_t merge;
+		nx::solver_base::unit_t unit;
+		for (auto &prefix : nx::solver_base::prefixes(2)) {
+			unit.cube_hash = unit.hash(c);
+			unit.prefix = prefix;
+			unit.depth = depth;
+			unit.found = S.solve_prefix(c6, prefix, unit.solution, depth);
+			unit.solution = unit.found ? unit.solution.canonical() : moveseq_t();
+
+			nx::solver_base::unit_t line;
+			CHECK(line.parse(unit.to_string()));
+			CHECK(line.cube_hash == unit.cube_hash);
+			CHECK(line.solution == unit.solution);
+			CHECK(merge.add(line) == nullptr);
+		}
+		CHECK(merge.complete());
+		CHECK(merge.found);
+		LONGS_EQUAL(direct.size(), merge.best.size());
+		CHECK(c * cube::from_moveseq(merge.best) == cube());
+
+		/* Units of another cube, split length or depth are rejected */
+		nx::solver_base::unit_t other = unit;
+		other.cube_hash = other.hash(c.move(0));
+		CHECK(merge.add(other) != nullptr);
+		other = unit;
+		other.prefix.pop_back();
+		CHECK(merge.add(other) != nullptr);
+		other = unit;
+		other.depth++;
+		CHECK(merge.add(other) != nullptr);
+
+		/* A missing unit leaves the merge incomplete */
+		nx::solver_base::merge_t partial;
+		partial.add(unit);
+		CHECK(!partial.complete());
+	}
+}
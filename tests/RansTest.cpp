@@ -0,0 +1,76 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "rans.h"
+
+#include <random>
+#include "CppUTest/TestHarness.h"
+
+using namespace vcube;
+
+TEST_GROUP(Rans) {
+	void round_trip(const std::vector<uint8_t> &in) {
+		std::vector<uint8_t> enc, dec(in.size());
+		rans::encode(in.data(), in.size(), enc);
+		CHECK(rans::decode(enc.data(), enc.size(), dec.data(), dec.size()));
+		CHECK(in == dec);
+	}
+};
+
+TEST(Rans, RoundTrip) {
+	std::mt19937 gen(1);
+	std::discrete_distribution<int> dist({ 1, 4, 20, 60 });
+
+	// Skewed 2-bit symbols, like a pruning table
+	std::vector<uint8_t> in(1 << 20);
+	for (auto &b : in) {
+		b = dist(gen) | dist(gen) << 2 | dist(gen) << 4 | dist(gen) << 6;
+	}
+
+	std::vector<uint8_t> enc;
+	rans::encode(in.data(), in.size(), enc);
+	CHECK(enc.size() < in.size() * 3 / 4);
+	round_trip(in);
+}
+
+TEST(Rans, EdgeCases) {
+	round_trip({});
+	round_trip({ 42 });
+	round_trip(std::vector<uint8_t>(100000, 0xff));
+
+	// Uniform random data is stored raw
+	std::mt19937 gen(2);
+	std::vector<uint8_t> in(65536);
+	for (auto &b : in) {
+		b = gen();
+	}
+	std::vector<uint8_t> enc;
+	rans::encode(in.data(), in.size(), enc);
+	CHECK(enc.size() == in.size() + 1);
+	round_trip(in);
+}
+
+TEST(Rans, Corrupt) {
+	std::vector<uint8_t> in(10000, 3), enc, dec(in.size());
+	for (size_t i = 0; i < in.size(); i += 7) {
+		in[i] = i;
+	}
+	rans::encode(in.data(), in.size(), enc);
+	CHECK_FALSE(rans::decode(enc.data(), enc.size() - 1, dec.data(), dec.size()));
+	CHECK_FALSE(rans::decode(enc.data(), enc.size(), dec.data(), dec.size() + 1));
+}
@@ -0,0 +1,112 @@
+/* This file is part of vcube.
+ *
+ * Copyright (C) 2018 Andrew Skalski
+ *
+ * vcube is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcube is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcube.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "uring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include "CppUTest/TestHarness.h"
+
+using namespace vcube;
+
+TEST_GROUP(Uring) {
+};
+
+namespace {
+	/* A ring whose io_uring_enter fails, after the first call lets the
+	 * kernel take "n_submit" of the queued reads.  Later calls fail
+	 * too, so completions can only be found in the ring itself.
+	 */
+	class failing_uring : public uring {
+		unsigned n_submit;
+		bool failed;
+
+	    public:
+		failing_uring(unsigned n_submit) : uring(64), n_submit(n_submit), failed() {
+		}
+
+	    protected:
+		int enter(unsigned to_submit, unsigned, unsigned) override {
+			if (!failed) {
+				failed = true;
+				uring::enter(std::min(to_submit, n_submit), 0, 0);
+			}
+			errno = EIO;
+			return -1;
+		}
+	};
+
+	constexpr int N_READS = 32, READ_LEN = 512, STRIDE = 1024;
+
+	uint8_t file_byte(size_t off) {
+		return (off * 7 + off / 256) & 0xff;
+	}
+}
+
+TEST(Uring, EnterFails) {
+	char filename[] = "/tmp/vcube-uring-XXXXXX";
+	int fd = mkstemp(filename);
+	CHECK(fd != -1);
+	unlink(filename);
+	std::vector<uint8_t> data(N_READS * STRIDE);
+	for (size_t i = 0; i < data.size(); i++) {
+		data[i] = file_byte(i);
+	}
+	LONGS_EQUAL(data.size(), write(fd, data.data(), data.size()));
+
+	/* Every read completes with the right data whether the kernel took
+	 * none, some or all of them before the failure
+	 */
+	for (unsigned n_submit : { 0, N_READS / 3, N_READS }) {
+		failing_uring ring(n_submit);
+		std::vector<uint8_t> buf(N_READS * READ_LEN);
+		for (int i = 0; i < N_READS; i++) {
+			ring.read(fd, buf.data() + i * READ_LEN, READ_LEN, i * STRIDE, i);
+		}
+
+		std::vector<int> res(N_READS, 0);
+		int n_done = 0;
+		ring.wait_all([&](uint64_t tag, int r) {
+				res[tag] = r;
+				n_done++;
+				});
+		LONGS_EQUAL(N_READS, n_done);
+		for (int i = 0; i < N_READS; i++) {
+			LONGS_EQUAL(READ_LEN, res[i]);
+			CHECK(memcmp(buf.data() + i * READ_LEN, data.data() + i * STRIDE, READ_LEN) == 0);
+		}
+
+		/* The ring is closed, and later reads go through pread */
+		CHECK(!ring.async());
+		memset(buf.data(), 0, READ_LEN);
+		ring.read(fd, buf.data(), READ_LEN, STRIDE, 0);
+		n_done = 0;
+		ring.wait_all([&](uint64_t, int r) {
+				LONGS_EQUAL(READ_LEN, r);
+				n_done++;
+				});
+		LONGS_EQUAL(1, n_done);
+		CHECK(memcmp(buf.data(), data.data() + STRIDE, READ_LEN) == 0);
+	}
+
+	close(fd);
+}
@@ -17,7 +17,12 @@
  */
 
 #include "cube.h"
+#include <cstdio>
+#include <cstdlib>
 #include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
 
 using namespace vcube;
 
@@ -52,6 +57,40 @@ struct t {
 		return c;
 	}
 
+	/* Creates an empty file with a unique name in /tmp, so that test
+	 * runs in parallel do not collide.  The caller unlinks it.
+	 */
+	static std::string temp_file() {
+		char name[] = "/tmp/vcube-test-XXXXXX";
+		int fd = mkstemp(name);
+		if (fd == -1) {
+			return "";
+		}
+		close(fd);
+		return name;
+	}
+
+	/* Loads P with random bytes from a table file without a header, and
+	 * returns the bytes (empty if the table could not be loaded)
+	 */
+	template<typename Prune>
+	static std::vector<uint8_t> random_table(Prune &P) {
+		std::vector<uint8_t> data(P.size());
+		for (auto &b : data) {
+			b = rand(256);
+		}
+
+		std::string name = temp_file();
+		FILE *fp = fopen(name.c_str(), "w");
+		bool ok = fp && fwrite(data.data(), data.size(), 1, fp) == 1;
+		ok = fp && !fclose(fp) && ok && P.load(name);
+		unlink(name.c_str());
+		if (!ok) {
+			data.clear();
+		}
+		return data;
+	}
+
     private:
 	static std::mt19937 rng;
 };